@@ -1,19 +1,71 @@
 
+#include <stdint.h>
+#include <string.h>
+
 struct FSE_ucode
 {
 	u8 data[0x200];
+	/* members named after their type are not valid C++, spell the types
+	 * out so as FSE_template.cpp can include this file
+	 */
 	union {
 		u8  *u08;
-		u16 *u16;
-		u32 *u32;
+		uint16_t *u16;
+		uint32_t *u32;
 	} ptr;
 	u16 len;	
+
+	/* last reg/val/mask seen by PDAEMON, only meaningful once they have been
+	 * set since the beginning of the script or the last label
+	 */
+	u32 reg;
+	u32 val;
+	u32 mask;
+	u8 known;
 };
 
+/* bits of FSE_ucode::known, also used by FSE_validate */
+#define FSE_KNOWN_REG	0x1
+#define FSE_KNOWN_VAL	0x2
+#define FSE_KNOWN_MASK	0x4
+
+static inline void
+FSE_reset_state(struct FSE_ucode *FSE)
+{
+	FSE->reg = 0xffffffff;
+	FSE->val = 0xffffffff;
+	FSE->mask = 0xffffffff;
+	FSE->known = 0;
+}
+
 static inline void
 FSE_init(struct FSE_ucode *FSE)
 {
 	FSE->ptr.u08 = FSE->data;	
+	FSE_reset_state(FSE);
+}
+
+/* whether reg can be emitted relatively to the last register */
+static inline int
+FSE_reg_rel(struct FSE_ucode *FSE, u32 reg)
+{
+	return (FSE->known & FSE_KNOWN_REG) &&
+	       (reg & 0xffff0000) == (FSE->reg & 0xffff0000);
+}
+
+/* emit the register, in its compact form if the high half is unchanged */
+static inline void
+FSE_reg(struct FSE_ucode *FSE, u8 op, u8 op_rel, u32 reg)
+{
+	if (FSE_reg_rel(FSE, reg)) {
+		*FSE->ptr.u08++ = op_rel;
+		*FSE->ptr.u16++ = (reg & 0x0000ffff);
+	} else {
+		*FSE->ptr.u08++ = op;
+		*FSE->ptr.u32++ = reg;
+	}
+	FSE->reg = reg;
+	FSE->known |= FSE_KNOWN_REG;
 }
 
 static inline void
@@ -57,34 +109,53 @@ FSE_delay_ns(struct FSE_ucode *FSE, u64 delay_ns)
 static inline void
 FSE_write(struct FSE_ucode *FSE, u32 reg, u32 val)
 {
+	int reg_rel = FSE_reg_rel(FSE, reg);
+
 	if ((val & 0xff) == val) {
-		*FSE->ptr.u08++ = 0x11;
-		*FSE->ptr.u32++ = reg;		
+		FSE_reg(FSE, 0x11, 0x15, reg);
 		*FSE->ptr.u08++ = val;
+	} else if (reg_rel && (FSE->known & FSE_KNOWN_VAL) &&
+		   (val & 0xffff0000) == (FSE->val & 0xffff0000)) {
+		FSE_reg(FSE, 0x16, 0x16, reg);
+		*FSE->ptr.u16++ = (val & 0x0000ffff);
 	} else {
-		*FSE->ptr.u08++ = 0x10;
-		*FSE->ptr.u32++ = reg;			
+		FSE_reg(FSE, 0x10, 0x14, reg);
 		*FSE->ptr.u32++ = val;
 	}
-
+	FSE->val = val;
+	FSE->known |= FSE_KNOWN_VAL;
 }
 
 static inline void
 FSE_mask(struct FSE_ucode *FSE, u32 reg, u32 mask, u32 data)
 {
-	*FSE->ptr.u08++ = 0x12;
-	*FSE->ptr.u32++ = reg;
-	*FSE->ptr.u32++ = mask;
+	int reg_rel = FSE_reg_rel(FSE, reg);
+
+	if (reg_rel && (FSE->known & FSE_KNOWN_MASK) && mask == FSE->mask) {
+		FSE_reg(FSE, 0x19, 0x19, reg);
+	} else {
+		FSE_reg(FSE, 0x12, 0x17, reg);
+		*FSE->ptr.u32++ = mask;
+	}
 	*FSE->ptr.u32++ = data;  
+	FSE->mask = mask;
+	FSE->known |= FSE_KNOWN_MASK;
 }
 
 static inline void
 FSE_wait(struct FSE_ucode *FSE, u32 reg, u32 mask, u32 data)
 {
-	*FSE->ptr.u08++ = 0x13;
-	*FSE->ptr.u32++ = reg;
-	*FSE->ptr.u32++ = mask;
+	int reg_rel = FSE_reg_rel(FSE, reg);
+
+	if (reg_rel && (FSE->known & FSE_KNOWN_MASK) && mask == FSE->mask) {
+		FSE_reg(FSE, 0x1a, 0x1a, reg);
+	} else {
+		FSE_reg(FSE, 0x13, 0x18, reg);
+		*FSE->ptr.u32++ = mask;
+	}
 	*FSE->ptr.u32++ = data;  
+	FSE->mask = mask;
+	FSE->known |= FSE_KNOWN_MASK;
 }
 
 static inline void
@@ -101,4 +172,304 @@ FSE_send_msg(struct FSE_ucode *FSE, u16 size, u8 *msg)
 	}
 }	
 
-  
\ No newline at end of file
+  
+
+/* returns the current position in the script, to be used as a jump target.
+ * Every jump target must come from FSE_label: PDAEMON may reach it with any
+ * reg/val/mask state, hence the state is forgotten.
+ */
+static inline u16
+FSE_label(struct FSE_ucode *FSE)
+{
+	FSE_reset_state(FSE);
+	return FSE->ptr.u08 - FSE->data;
+}
+
+static inline u16
+FSE_jmp(struct FSE_ucode *FSE, u16 target)
+{
+	u16 insn = FSE->ptr.u08 - FSE->data;
+
+	*FSE->ptr.u08++ = 0x30;
+	*FSE->ptr.u16++ = target - (insn + 3);
+
+	return insn;
+}
+
+
+static inline u16
+FSE_br_eq(struct FSE_ucode *FSE, u32 reg, u32 mask, u32 data, u16 target)
+{
+	u16 insn = FSE->ptr.u08 - FSE->data;
+
+	*FSE->ptr.u08++ = 0x32;
+	*FSE->ptr.u32++ = reg;
+	*FSE->ptr.u32++ = mask;
+	*FSE->ptr.u32++ = data;
+	*FSE->ptr.u16++ = target - (insn + 15);
+
+	return insn;
+}
+
+/* size of the instruction found at data[pos], 0 if it is invalid */
+static inline u16
+FSE_insn_size(const u8 *data, u16 pos, u16 len)
+{
+	u16 size;
+
+	switch (data[pos]) {
+	case 0x00: size = 9; break;
+	case 0x01: size = 3; break;
+	case 0x02: size = 3; break;
+	case 0x10: size = 9; break;
+	case 0x11: size = 6; break;
+	case 0x12: size = 13; break;
+	case 0x13: size = 13; break;
+	case 0x14: size = 7; break;
+	case 0x15: size = 4; break;
+	case 0x16: size = 5; break;
+	case 0x17: size = 11; break;
+	case 0x18: size = 11; break;
+	case 0x19: size = 7; break;
+	case 0x1a: size = 7; break;
+	case 0x20:
+		if (pos + 3 > len)
+			return 0;
+		size = 3 + (data[pos + 1] | data[pos + 2] << 8);
+		break;
+	case 0x30: size = 3; break;
+	case 0x31: size = 7; break;
+	case 0x32: size = 15; break;
+	case 0x33: size = 3; break;
+	case 0xff: size = 1; break;
+	default: return 0;
+	}
+
+	if (pos + size > len)
+		return 0;
+
+	return size;
+}
+
+/* position of the OFFSET operand of a jump instruction (or of the loop a
+ * loop_init points at), 0 if it is not one
+ */
+static inline u16
+FSE_jmp_offset_pos(const u8 *data, u16 insn)
+{
+	switch (data[insn]) {
+	case 0x30: return insn + 1;
+	case 0x31: return insn + 5;
+	case 0x32: return insn + 13;
+	case 0x33: return insn + 1;
+	default: return 0;
+	}
+}
+
+/* make a previously-emitted jump point to target (forward jumps) */
+static inline void
+FSE_set_target(struct FSE_ucode *FSE, u16 insn, u16 target)
+{
+	u16 pos = FSE_jmp_offset_pos(FSE->data, insn);
+	u16 offset = target - (insn + FSE_insn_size(FSE->data, insn, sizeof(FSE->data)));
+
+	if (!pos)
+		return;
+
+	FSE->data[pos] = offset & 0xff;
+	FSE->data[pos + 1] = offset >> 8;
+}
+
+/* start a counted loop: emits the loop_init resetting its CUR every time the
+ * loop is entered and returns the position of the loop body, for FSE_loop.
+ */
+static inline u16
+FSE_loop_begin(struct FSE_ucode *FSE)
+{
+	*FSE->ptr.u08++ = 0x33;
+	*FSE->ptr.u16++ = 0;
+
+	return FSE_label(FSE);
+}
+
+/* execute the instructions between target and the loop count times.
+ * target must come from FSE_loop_begin, whose loop_init is pointed at the
+ * loop instruction.
+ */
+static inline u16
+FSE_loop(struct FSE_ucode *FSE, u16 count, u16 target)
+{
+	u16 insn = FSE->ptr.u08 - FSE->data;
+
+	*FSE->ptr.u08++ = 0x31;
+	*FSE->ptr.u16++ = count;
+	*FSE->ptr.u16++ = 0;
+	*FSE->ptr.u16++ = target - (insn + 7);
+
+	if (target >= 3 && FSE->data[target - 3] == 0x33)
+		FSE_set_target(FSE, target - 3, insn);
+
+	return insn;
+}
+
+/* target of the jump instruction at data[insn], -1 if it is not one */
+static inline int
+FSE_jmp_target(const u8 *data, u16 insn, u16 len)
+{
+	u16 off_pos = FSE_jmp_offset_pos(data, insn);
+
+	if (!off_pos)
+		return -1;
+
+	return insn + FSE_insn_size(data, insn, len) +
+	       (short)(data[off_pos] | data[off_pos + 1] << 8);
+}
+
+/* reg/val/mask state (FSE_KNOWN_*) the compact form at data[insn] relies on */
+static inline u8
+FSE_insn_uses(const u8 *data, u16 insn)
+{
+	switch (data[insn]) {
+	case 0x14: case 0x15: case 0x17: case 0x18:
+		return FSE_KNOWN_REG;
+	case 0x16:
+		return FSE_KNOWN_REG | FSE_KNOWN_VAL;
+	case 0x19: case 0x1a:
+		return FSE_KNOWN_REG | FSE_KNOWN_MASK;
+	default:
+		return 0;
+	}
+}
+
+/* reg/val/mask state (FSE_KNOWN_*) set by the instruction at data[insn] */
+static inline u8
+FSE_insn_sets(const u8 *data, u16 insn)
+{
+	switch (data[insn]) {
+	case 0x10: case 0x11: case 0x14: case 0x15: case 0x16:
+		return FSE_KNOWN_REG | FSE_KNOWN_VAL;
+	case 0x12: case 0x13: case 0x17: case 0x18: case 0x19: case 0x1a:
+		return FSE_KNOWN_REG | FSE_KNOWN_MASK;
+	default:
+		return 0;
+	}
+}
+
+/* check that the script only contains valid instructions, that every jump
+ * lands on the first byte of an instruction and that loops are sane: every
+ * loop body must be preceded by the loop_init of its loop and may only be
+ * entered through it, so as CUR is always reset when the loop starts over.
+ * Compact forms are only accepted when the reg/val/mask they rely on is set
+ * on every path leading to them.
+ * To be called after FSE_fini.
+ * Returns 0 if the script is valid, the position of the first faulty
+ * instruction + 1 otherwise.
+ */
+static inline int
+FSE_validate(struct FSE_ucode *FSE)
+{
+	u8 insn_start[sizeof(FSE->data)] = { 0 };
+	u8 known[sizeof(FSE->data)];
+	const u8 *data = FSE->data;
+	u16 pos, size, loop, loops = 0;
+	int changed;
+
+	if (FSE->len == 0 || FSE->len > sizeof(FSE->data))
+		return 1;
+
+	for (pos = 0; pos < FSE->len; pos += size) {
+		size = FSE_insn_size(data, pos, FSE->len);
+		if (!size)
+			return pos + 1;
+		insn_start[pos] = 1;
+	}
+
+	if (data[FSE->len - 1] != 0xff || !insn_start[FSE->len - 1])
+		return FSE->len;
+
+	for (pos = 0; pos < FSE->len; pos += size) {
+		int target = FSE_jmp_target(data, pos, FSE->len);
+
+		size = FSE_insn_size(data, pos, FSE->len);
+		if (target == -1)
+			continue;
+
+		if (target < 0 || target >= FSE->len || !insn_start[target])
+			return pos + 1;
+
+		/* a loop_init must point at a loop */
+		if (data[pos] == 0x33 && data[target] != 0x31)
+			return pos + 1;
+
+		if (data[pos] != 0x31)
+			continue;
+		loops++;
+
+		/* loops need a count, must start with CUR = 0 and jump back
+		 * right after their loop_init
+		 */
+		if (!(data[pos + 1] | data[pos + 2] << 8) ||
+		    (data[pos + 3] | data[pos + 4] << 8))
+			return pos + 1;
+
+		if (target > pos || target < 3 || !insn_start[target - 3] ||
+		    FSE_jmp_target(data, target - 3, FSE->len) != pos)
+			return pos + 1;
+	}
+
+	/* no jump from outside of a loop may land in its body */
+	for (loop = 0; loops && loop < FSE->len; loop += FSE_insn_size(data, loop, FSE->len)) {
+		int body;
+
+		if (data[loop] != 0x31)
+			continue;
+
+		body = FSE_jmp_target(data, loop, FSE->len);
+		loops--;
+		for (pos = 0; pos < FSE->len; pos += size) {
+			int target = FSE_jmp_target(data, pos, FSE->len);
+
+			size = FSE_insn_size(data, pos, FSE->len);
+			if (data[pos] == 0x33 || target < body || target > loop)
+				continue;
+
+			if (pos < body || pos > loop)
+				return pos + 1;
+		}
+	}
+
+	/* state known when reaching each instruction, through every path, 0xff
+	 * until the instruction is found reachable. It can only lose bits, hence
+	 * a compact form lacking its state can be rejected right away. Another
+	 * pass is only needed when a backward jump lost some bits.
+	 */
+	memset(known, 0xff, FSE->len);
+	known[0] = 0;
+	do {
+		changed = 0;
+		for (pos = 0; pos < FSE->len; pos += size) {
+			u8 uses = FSE_insn_uses(data, pos);
+			u8 out = known[pos] | FSE_insn_sets(data, pos);
+			int next[2], i;
+
+			size = FSE_insn_size(data, pos, FSE->len);
+			if (known[pos] == 0xff)
+				continue;
+
+			if ((known[pos] & uses) != uses)
+				return pos + 1;
+
+			next[0] = (data[pos] == 0x30 || data[pos] == 0xff) ? -1 : pos + size;
+			next[1] = data[pos] == 0x33 ? -1 : FSE_jmp_target(data, pos, FSE->len);
+			for (i = 0; i < 2; i++) {
+				if (next[i] < 0 || (known[next[i]] & out) == known[next[i]])
+					continue;
+				known[next[i]] &= out;
+				if (next[i] <= pos)
+					changed = 1;
+			}
+		}
+	} while (changed);
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Compile-time FSE script construction.
+ *
+ * Fixed scripts can be built at compile time instead of going through the
+ * FSE_init/FSE_write/.../FSE_fini helpers of FSE.h at runtime:
+ *
+ *	using reclock = fse::script<
+ *		fse::write<0x100210, 0x80000000>,
+ *		fse::wait<0x100200, 0xffff0000, 0x0>,
+ *		fse::delay_ns<2000>
+ *	>;
+ *
+ *	data_segment_upload_u8(cnum, slot_addr, reclock::data.data(), reclock::size);
+ *
+ * The bytes are the same as the ones FSE.h would generate, compact forms
+ * included, and the trailing exit is appended. A script that does not fit in
+ * a FSE slot (fse::slot_size) does not compile.
+ *
+ * Control flow (jmp, loop, br_eq) is not supported, use FSE.h for these.
+ *
+ * Requires C++17.
+ */
+
+#ifndef __FSE_HPP__
+#define __FSE_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace fse {
+
+/* size of a FSE script slot in PDAEMON, see FSE_slots in pdaemon.fuc */
+constexpr std::size_t slot_size = 0x200;
+
+/* Byte sink mirroring struct FSE_ucode. Bytes past N are only counted so as
+ * the size of an oversized script can still be reported.
+ */
+template <std::size_t N>
+struct writer {
+	std::uint8_t data[N] = {};
+	std::size_t len = 0;
+
+	/* last reg/val/mask seen by PDAEMON, only meaningful once known */
+	std::uint32_t reg = 0xffffffff;
+	std::uint32_t val = 0xffffffff;
+	std::uint32_t mask = 0xffffffff;
+	bool reg_known = false;
+	bool val_known = false;
+	bool mask_known = false;
+
+	constexpr void u08(std::uint32_t v)
+	{
+		if (len < N)
+			data[len] = v & 0xff;
+		len++;
+	}
+
+	constexpr void u16(std::uint32_t v)
+	{
+		u08(v);
+		u08(v >> 8);
+	}
+
+	constexpr void u32(std::uint32_t v)
+	{
+		u16(v);
+		u16(v >> 16);
+	}
+
+	constexpr bool reg_rel(std::uint32_t r) const
+	{
+		return reg_known && (r & 0xffff0000) == (reg & 0xffff0000);
+	}
+
+	/* FSE_reg */
+	constexpr void emit_reg(std::uint8_t op, std::uint8_t op_rel, std::uint32_t r)
+	{
+		if (reg_rel(r)) {
+			u08(op_rel);
+			u16(r & 0x0000ffff);
+		} else {
+			u08(op);
+			u32(r);
+		}
+		reg = r;
+		reg_known = true;
+	}
+};
+
+/* FSE_delay_ns */
+template <std::uint64_t Ns>
+struct delay_ns {
+	template <typename W>
+	static constexpr void emit(W &w)
+	{
+		if (Ns <= 0xffff * 32) {
+			w.u08(0x01);
+			w.u16(Ns / 32);
+		} else if (Ns <= 0xffff * 1000) {
+			w.u08(0x02);
+			w.u16(Ns / 1000);
+
+			if (Ns % 1000 >= 32) {
+				w.u08(0x01);
+				w.u16((Ns % 1000) / 32);
+			}
+		} else {
+			w.u08(0x00);
+			w.u32(Ns >> 32);
+			w.u32(Ns & 0xffffffff);
+		}
+	}
+};
+
+/* FSE_write */
+template <std::uint32_t Reg, std::uint32_t Val>
+struct write {
+	template <typename W>
+	static constexpr void emit(W &w)
+	{
+		if ((Val & 0xff) == Val) {
+			w.emit_reg(0x11, 0x15, Reg);
+			w.u08(Val);
+		} else if (w.reg_rel(Reg) && w.val_known &&
+			   (Val & 0xffff0000) == (w.val & 0xffff0000)) {
+			w.emit_reg(0x16, 0x16, Reg);
+			w.u16(Val & 0x0000ffff);
+		} else {
+			w.emit_reg(0x10, 0x14, Reg);
+			w.u32(Val);
+		}
+		w.val = Val;
+		w.val_known = true;
+	}
+};
+
+/* FSE_mask and FSE_wait */
+template <std::uint8_t Op, std::uint8_t OpRel, std::uint8_t OpLast,
+	  std::uint32_t Reg, std::uint32_t Mask, std::uint32_t Data>
+struct reg_mask_data {
+	template <typename W>
+	static constexpr void emit(W &w)
+	{
+		if (w.reg_rel(Reg) && w.mask_known && Mask == w.mask) {
+			w.emit_reg(OpLast, OpLast, Reg);
+		} else {
+			w.emit_reg(Op, OpRel, Reg);
+			w.u32(Mask);
+		}
+		w.u32(Data);
+		w.mask = Mask;
+		w.mask_known = true;
+	}
+};
+
+template <std::uint32_t Reg, std::uint32_t Mask, std::uint32_t Data>
+struct mask : reg_mask_data<0x12, 0x17, 0x19, Reg, Mask, Data> {};
+
+template <std::uint32_t Reg, std::uint32_t Mask, std::uint32_t Data>
+struct wait : reg_mask_data<0x13, 0x18, 0x1a, Reg, Mask, Data> {};
+
+/* FSE_send_msg */
+template <std::uint8_t... Msg>
+struct send_msg {
+	static_assert(sizeof...(Msg) <= 0xffff, "FSE message too long");
+
+	template <typename W>
+	static constexpr void emit(W &w)
+	{
+		w.u08(0x20);
+		w.u16(sizeof...(Msg));
+		(w.u08(Msg), ...);
+	}
+};
+
+template <typename... Ops>
+struct script {
+private:
+	static constexpr writer<slot_size> encode()
+	{
+		writer<slot_size> w;
+
+		(Ops::emit(w), ...);
+		w.u08(0xff); /* FSE_fini */
+
+		return w;
+	}
+
+	static constexpr writer<slot_size> encoded = encode();
+
+public:
+	static constexpr std::size_t size = encoded.len;
+	static_assert(size <= slot_size, "FSE script does not fit in a FSE slot");
+
+private:
+	static constexpr std::array<std::uint8_t, size> copy()
+	{
+		std::array<std::uint8_t, size> a = {};
+
+		for (std::size_t i = 0; i < size; i++)
+			a[i] = i < slot_size ? encoded.data[i] : 0;
+
+		return a;
+	}
+
+public:
+	static constexpr std::array<std::uint8_t, size> data = copy();
+};
+
+} /* namespace fse */
+
+#endif
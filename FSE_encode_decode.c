@@ -1,10 +1,12 @@
 #include <stdio.h>
+#include <string.h>
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 #include "FSE.h"
+#include "FSE_lz.h"
 
 u32 le32 (const u8 *buf, int *off) 
 {
@@ -27,8 +29,11 @@ u8 le8 (const u8 *buf, int *off)
 int main(int argc, char **argv) 
 {
 	struct FSE_ucode code, *ucode = &code;
-	int i, size, reg, val, mask;
-	u8 msg[5];
+	int i, size, reg, val, mask, ret;
+	u32 last_reg = 0xffffffff, last_val = 0xffffffff, last_mask = 0xffffffff;
+	u16 loop_start, br;
+	u8 msg[5], lz[0x200], unpacked[0x200];
+	int lz_len;
 	msg[0] = 0x05;
 	msg[1] = 0x46;
 	msg[2] = 0x36;
@@ -38,11 +43,27 @@ int main(int argc, char **argv)
 	FSE_init(ucode);
 	FSE_write(ucode, 0x12345678, 0xdeadbeef);
 	FSE_write(ucode, 0x12345678, 0xef);
+	FSE_write(ucode, 0x1234567c, 0x12345);
+	FSE_write(ucode, 0x12345680, 0x1beef);
+	FSE_mask(ucode, 0x12345684, 0x0f0f0f0f, 0x10);
+	FSE_wait(ucode, 0x12345688, 0x0f0f0f0f, 0x20);
 	FSE_wait(ucode, 0x12345678, 0x0f0f0f0f, 0xdeadbeef);
 	FSE_mask(ucode, 0x12345678, 0x0f0f0f0f, 0xdeadbeef);
 	FSE_delay_ns(ucode, 9999999);
 	FSE_send_msg(ucode, 5, msg);
+
+	/* poll a register 16 times, bail out early if it is ready */
+	loop_start = FSE_loop_begin(ucode);
+	br = FSE_br_eq(ucode, 0x12345678, 0x1, 0x1, 0);
+	FSE_delay_ns(ucode, 1000);
+	FSE_loop(ucode, 16, loop_start);
+	FSE_set_target(ucode, br, FSE_label(ucode));
+	FSE_write(ucode, 0x12345678, 0x0);
 	FSE_fini(ucode);
+
+	ret = FSE_validate(ucode);
+	if (ret)
+		printf("invalid program: faulty instruction at 0x%x\n", ret - 1);
 	
 	/* print the generated code */
 	printf("encoded program: ucode->len = %i bytes", ucode->len);
@@ -52,6 +73,14 @@ int main(int argc, char **argv)
 		printf("%01x ", ucode->ptr.u08[i]);
 	}
 	printf("\n\n");
+
+	/* compress it the way run.c sends it to PDAEMON, then check it unpacks */
+	lz_len = FSE_lz_compress(ucode->ptr.u08, ucode->len, lz, sizeof(lz));
+	ret = FSE_lz_decompress(lz, lz_len, unpacked, sizeof(unpacked));
+	printf("compressed program: %i bytes (%i%%), %s\n\n", lz_len,
+	       lz_len * 100 / ucode->len,
+	       ret == ucode->len && !memcmp(unpacked, ucode->ptr.u08, ret) ?
+	       "unpacks fine" : "UNPACK MISMATCH");
 	
 	/* decode */
 	printf("decode program:\n");
@@ -75,29 +104,50 @@ int main(int argc, char **argv)
 				break;
 				
 			case 0x10:
-				reg = le32(ucode->ptr.u08, &i);
-				val = le32(ucode->ptr.u08, &i);
-				printf("FSE_write(0x%08x, 0x%08x);\n", reg, val);
-				break;
-			
 			case 0x11:
-				reg = le32(ucode->ptr.u08, &i);
-				val = le8(ucode->ptr.u08, &i);
-				printf("FSE_write(0x%08x, 0x%02x);\n", reg, val);
+			case 0x14:
+			case 0x15:
+			case 0x16:
+				if (opcode == 0x10 || opcode == 0x11)
+					reg = le32(ucode->ptr.u08, &i);
+				else
+					reg = (last_reg & 0xffff0000) | le16(ucode->ptr.u08, &i);
+
+				if (opcode == 0x11 || opcode == 0x15)
+					val = le8(ucode->ptr.u08, &i);
+				else if (opcode == 0x16)
+					val = (last_val & 0xffff0000) | le16(ucode->ptr.u08, &i);
+				else
+					val = le32(ucode->ptr.u08, &i);
+
+				last_reg = reg;
+				last_val = val;
+				printf("FSE_write(0x%08x, 0x%08x);\n", reg, val);
 				break;
 			
 			case 0x12:
-				reg = le32(ucode->ptr.u08, &i);
-				mask = le32(ucode->ptr.u08, &i);
-				val = le32(ucode->ptr.u08, &i);
-				printf("FSE_mask(0x%08x, 0x%08x, 0x%08x);\n",reg, mask, val);
-				break;
-				
 			case 0x13:
-				reg = le32(ucode->ptr.u08, &i);
-				mask = le32(ucode->ptr.u08, &i);
+			case 0x17:
+			case 0x18:
+			case 0x19:
+			case 0x1a:
+				if (opcode == 0x12 || opcode == 0x13)
+					reg = le32(ucode->ptr.u08, &i);
+				else
+					reg = (last_reg & 0xffff0000) | le16(ucode->ptr.u08, &i);
+
+				if (opcode == 0x19 || opcode == 0x1a)
+					mask = last_mask;
+				else
+					mask = le32(ucode->ptr.u08, &i);
 				val = le32(ucode->ptr.u08, &i);
-				printf("FSE_wait(0x%08x, 0x%08x, 0x%08x);\n", reg, mask, val);
+
+				last_reg = reg;
+				last_mask = mask;
+				if (opcode == 0x12 || opcode == 0x17 || opcode == 0x19)
+					printf("FSE_mask(0x%08x, 0x%08x, 0x%08x);\n",reg, mask, val);
+				else
+					printf("FSE_wait(0x%08x, 0x%08x, 0x%08x);\n", reg, mask, val);
 				break;
 				
 			case 0x20:
@@ -111,6 +161,29 @@ int main(int argc, char **argv)
 				printf(")\n");
 				break; 
 			
+			case 0x30:
+				printf("FSE_jmp(%d)\n", (short)le16(ucode->ptr.u08, &i));
+				break;
+
+			case 0x31:
+				val = le16(ucode->ptr.u08, &i);
+				size = le16(ucode->ptr.u08, &i);
+				printf("FSE_loop(%d, %d, %d)\n", val, size,
+				       (short)le16(ucode->ptr.u08, &i));
+				break;
+
+			case 0x33:
+				printf("FSE_loop_init(%d)\n", (short)le16(ucode->ptr.u08, &i));
+				break;
+
+			case 0x32:
+				reg = le32(ucode->ptr.u08, &i);
+				mask = le32(ucode->ptr.u08, &i);
+				val = le32(ucode->ptr.u08, &i);
+				printf("FSE_br_eq(0x%08x, 0x%08x, 0x%08x, %d);\n", reg, mask, val,
+				       (short)le16(ucode->ptr.u08, &i));
+				break;
+
 			case 0xff:
 				printf("exit\n");
 				break;
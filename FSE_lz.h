@@ -0,0 +1,135 @@
+/*
+ * FSE script compression, see "Compressed Scripts" in FSE.txt.
+ *
+ * Token stream:
+ * - 0x00-0x7f: literal run, (token + 1) bytes follow
+ * - 0x80-0xff: match of (token & 0x7f) + 3 bytes, a little-endian u16 offset
+ * 	(distance back from the current output position) follows
+ *
+ * The compressor is a plain greedy longest-match search over the whole script.
+ * Scripts are at most a FSE slot long so as there is no need for anything
+ * smarter.
+ */
+
+#ifndef __FSE_LZ_H__
+#define __FSE_LZ_H__
+
+#include <stdint.h>
+
+#define FSE_LZ_LITERAL_MAX 0x80
+#define FSE_LZ_MATCH_MIN 3
+#define FSE_LZ_MATCH_MAX (0x7f + FSE_LZ_MATCH_MIN)
+
+/* emit the pending literal run src[0..len[, returns the new output size or
+ * -1 if it does not fit in dst_size
+ */
+static inline int
+FSE_lz_literals(const uint8_t *src, uint16_t len, uint8_t *dst, int out,
+		uint16_t dst_size)
+{
+	int i;
+
+	if (len == 0)
+		return out;
+
+	if (out + 1 + len > dst_size)
+		return -1;
+
+	dst[out++] = len - 1;
+	for (i = 0; i < len; i++)
+		dst[out++] = src[i];
+
+	return out;
+}
+
+/* compress src into dst, returns the compressed size or 0 if it does not fit
+ * in dst_size bytes
+ */
+static inline uint16_t
+FSE_lz_compress(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t dst_size)
+{
+	uint16_t pos = 0, lit = 0;
+	int out = 0;
+
+	while (pos < len) {
+		uint16_t best_len = 0, best_off = 0, cand;
+
+		/* look for the longest match, the closest one on ties */
+		for (cand = 0; cand < pos; cand++) {
+			uint16_t l = 0;
+
+			while (pos + l < len && l < FSE_LZ_MATCH_MAX &&
+			       src[cand + l] == src[pos + l])
+				l++;
+
+			if (l >= best_len) {
+				best_len = l;
+				best_off = pos - cand;
+			}
+		}
+
+		if (best_len < FSE_LZ_MATCH_MIN) {
+			pos++;
+			if (++lit == FSE_LZ_LITERAL_MAX) {
+				out = FSE_lz_literals(src + pos - lit, lit, dst, out, dst_size);
+				if (out < 0)
+					return 0;
+				lit = 0;
+			}
+			continue;
+		}
+
+		out = FSE_lz_literals(src + pos - lit, lit, dst, out, dst_size);
+		if (out < 0 || out + 3 > dst_size)
+			return 0;
+		lit = 0;
+
+		dst[out++] = 0x80 | (best_len - FSE_LZ_MATCH_MIN);
+		dst[out++] = best_off & 0xff;
+		dst[out++] = best_off >> 8;
+		pos += best_len;
+	}
+
+	out = FSE_lz_literals(src + pos - lit, lit, dst, out, dst_size);
+	if (out < 0)
+		return 0;
+
+	return out;
+}
+
+/* host-side mirror of FSE_lz_unpack in pdaemon.fuc, returns the unpacked size
+ * or -1 if the stream is corrupted or does not fit in dst_size bytes
+ */
+static inline int
+FSE_lz_decompress(const uint8_t *src, uint16_t len, uint8_t *dst, uint16_t dst_size)
+{
+	uint16_t in = 0, out = 0, n, off;
+
+	while (in < len) {
+		uint8_t token = src[in++];
+
+		if (token < 0x80) {
+			n = token + 1;
+			if (in + n > len || out + n > dst_size)
+				return -1;
+			while (n--)
+				dst[out++] = src[in++];
+		} else {
+			n = (token & 0x7f) + FSE_LZ_MATCH_MIN;
+			if (in + 2 > len)
+				return -1;
+			off = src[in] | src[in + 1] << 8;
+			in += 2;
+			if (off == 0 || off > out || out + n > dst_size)
+				return -1;
+			while (n--) {
+				dst[out] = dst[out - off];
+				out++;
+			}
+		}
+	}
+
+	return out;
+}
+
+#endif
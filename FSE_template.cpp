@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "FSE.hpp"
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+#include "FSE.h"
+
+/* the script of FSE_encode_decode.c, without the control flow part */
+using test_script = fse::script<
+	fse::write<0x12345678, 0xdeadbeef>,
+	fse::write<0x12345678, 0xef>,
+	fse::write<0x1234567c, 0x12345>,
+	fse::write<0x12345680, 0x1beef>,
+	fse::mask<0x12345684, 0x0f0f0f0f, 0x10>,
+	fse::wait<0x12345688, 0x0f0f0f0f, 0x20>,
+	fse::wait<0x12345678, 0x0f0f0f0f, 0xdeadbeef>,
+	fse::mask<0x12345678, 0x0f0f0f0f, 0xdeadbeef>,
+	fse::delay_ns<9999999>,
+	fse::send_msg<0x05, 0x46, 0x36, 0x26, 0x16>
+>;
+
+/* build the same script at run time, through FSE.h */
+static void build_expected(struct FSE_ucode *u)
+{
+	u8 msg[] = { 0x05, 0x46, 0x36, 0x26, 0x16 };
+
+	FSE_init(u);
+	FSE_write(u, 0x12345678, 0xdeadbeef);
+	FSE_write(u, 0x12345678, 0xef);
+	FSE_write(u, 0x1234567c, 0x12345);
+	FSE_write(u, 0x12345680, 0x1beef);
+	FSE_mask(u, 0x12345684, 0x0f0f0f0f, 0x10);
+	FSE_wait(u, 0x12345688, 0x0f0f0f0f, 0x20);
+	FSE_wait(u, 0x12345678, 0x0f0f0f0f, 0xdeadbeef);
+	FSE_mask(u, 0x12345678, 0x0f0f0f0f, 0xdeadbeef);
+	FSE_delay_ns(u, 9999999);
+	FSE_send_msg(u, sizeof(msg), msg);
+	FSE_fini(u);
+}
+
+int main(int argc, char **argv)
+{
+	struct FSE_ucode expected;
+	unsigned i;
+
+	build_expected(&expected);
+
+	printf("compile-time program: %zu bytes", test_script::size);
+	for (i = 0; i < test_script::size; i++) {
+		if (i % 16 == 0)
+			printf("\n%08x: ", i);
+		printf("%02x ", test_script::data[i]);
+	}
+	printf("\n");
+
+	if (test_script::size != expected.len ||
+	    memcmp(test_script::data.data(), expected.data, expected.len) != 0) {
+		fprintf(stderr, "FSE.hpp and FSE.h disagree (%zu vs %u bytes)\n",
+			test_script::size, expected.len);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,656 @@
+/*
+ * Microbenchmarks for the script encoders/decoders and for the host <-> PDAEMON
+ * paths of run.c. The latter run against the simulated BAR0 of bench/nva.h.
+ *
+ * Build and run from the top directory. run.c is included as-is, its debug
+ * helpers are not called from here:
+ *	gcc -O2 -Wall -Wno-unused-function -Ibench bench/bench.c -o bench/bench
+ *	./bench/bench [-o results] [-b baseline] [-s baseline] [-T threshold] [-M threshold]
+ *
+ * Methodology: every case runs bench_warmup batches, then bench_reps timed
+ * batches of its batch size. The time per operation of each batch gives the
+ * p50/p90/p99, the MMIO accesses per operation are exact. One line per case:
+ *	name ops/s p50_ns p90_ns p99_ns mmio_rd mmio_wr
+ *
+ * -b compares the run to a baseline in the same format and fails if a case
+ * does more than -M (default 0) more MMIO accesses. The MMIO counts are
+ * deterministic, the times are not: they are only checked when -T is given,
+ * failing a case more than -T (e.g. 0.25, i.e. 25%) slower at p50, against
+ * a baseline stored with -s on the same machine. -s stores the run as the
+ * new baseline. bench/baseline.txt is the reference of the tree for the MMIO
+ * counts, its times are only indicative.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define main run_main
+#include "../run.c"
+#undef main
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+#include "../FSE.h"
+#include "../nouveau_hwsq.h"
+
+#define BENCH_MAX_CASES 32
+#define BENCH_MAX_REPS 1000
+
+static int bench_warmup = 3;
+static int bench_reps = 50;
+
+struct bench_case {
+	const char *name;
+	int batch;
+	void (*run)(void);
+};
+
+struct bench_result {
+	char name[64];
+	double ops;
+	double p50, p90, p99;	/* ns per op */
+	double mmio_rd, mmio_wr;	/* per op */
+};
+
+/* keep the compiler from optimizing the work away */
+static volatile uint32_t bench_sink;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a memory reclock-like sequence, the same one for FSE and hwsq */
+static void
+bench_build_FSE(struct FSE_ucode *u)
+{
+	int p, i;
+
+	FSE_init(u);
+	FSE_mask(u, 0x1002d4, 0x1, 0x1);
+	FSE_mask(u, 0x1002d0, 0x1, 0x1);
+	FSE_wait(u, 0x100200, 0x10000000, 0x0);
+	for (p = 0; p < 4; p++) {
+		FSE_write(u, 0x1002dc, p);
+		FSE_write(u, 0x1002d4, 1);
+		FSE_delay_ns(u, 1000);
+		FSE_write(u, 0x1002d0, 1);
+		FSE_delay_ns(u, 1000);
+	}
+	FSE_mask(u, 0x004000, 0x80000000, 0);
+	FSE_write(u, 0x004004, 0x00011c02);
+	FSE_mask(u, 0x004000, 0x80000000, 0x80000000);
+	FSE_wait(u, 0x004000, 0x00020000, 0x00020000);
+	for (i = 0; i < 10; i++)
+		FSE_write(u, 0x100220 + i * 4, 0x1a0a0506 + i * 0x01010101);
+	for (p = 0; p < 4; p++) {
+		FSE_write(u, 0x1002dc, p);
+		FSE_write(u, 0x1002c0, 0x00000e42);
+		FSE_delay_ns(u, 1000);
+		FSE_write(u, 0x1002c4, 0x00000000);
+		FSE_delay_ns(u, 1000);
+	}
+	FSE_mask(u, 0x1002d4, 0x1, 0x0);
+	FSE_mask(u, 0x1002d0, 0x1, 0x0);
+	FSE_fini(u);
+}
+
+/* hwsq has no mask/wait, the masks are plain writes */
+static void
+bench_build_hwsq(struct hwsq_ucode *u)
+{
+	int p, i;
+
+	hwsq_init(u);
+	hwsq_wr32(u, 0x1002d4, 0x1);
+	hwsq_wr32(u, 0x1002d0, 0x1);
+	hwsq_setf(u, 0x10, 0);
+	for (p = 0; p < 4; p++) {
+		hwsq_wr32(u, 0x1002dc, p);
+		hwsq_wr32(u, 0x1002d4, 1);
+		hwsq_usec(u, 1);
+		hwsq_wr32(u, 0x1002d0, 1);
+		hwsq_usec(u, 1);
+	}
+	hwsq_wr32(u, 0x004000, 0);
+	hwsq_wr32(u, 0x004004, 0x00011c02);
+	hwsq_wr32(u, 0x004000, 0x80000000);
+	hwsq_setf(u, 0x11, 1);
+	for (i = 0; i < 10; i++)
+		hwsq_wr32(u, 0x100220 + i * 4, 0x1a0a0506 + i * 0x01010101);
+	for (p = 0; p < 4; p++) {
+		hwsq_wr32(u, 0x1002dc, p);
+		hwsq_wr32(u, 0x1002c0, 0x00000e42);
+		hwsq_usec(u, 1);
+		hwsq_wr32(u, 0x1002c4, 0x00000000);
+		hwsq_usec(u, 1);
+	}
+	hwsq_wr32(u, 0x1002d4, 0x0);
+	hwsq_wr32(u, 0x1002d0, 0x0);
+	hwsq_fini(u);
+}
+
+static struct FSE_ucode bench_FSE;
+static struct hwsq_ucode bench_hwsq;
+static uint8_t bench_lz[PDAEMON_FSE_LZ_SIZE];
+static uint16_t bench_lz_len;
+static uint8_t bench_buf[0x200];
+
+static void
+bench_FSE_encode(void)
+{
+	struct FSE_ucode u;
+
+	bench_build_FSE(&u);
+	bench_sink = u.len;
+}
+
+static void
+bench_hwsq_encode(void)
+{
+	struct hwsq_ucode u;
+
+	bench_build_hwsq(&u);
+	bench_sink = u.len;
+}
+
+/* walk the script, checking every instruction and jump target */
+static void
+bench_FSE_validate(void)
+{
+	bench_sink = FSE_validate(&bench_FSE);
+}
+
+static inline u32
+bench_le16(const u8 *d, int i)
+{
+	return d[i] | d[i + 1] << 8;
+}
+
+static inline u32
+bench_le32(const u8 *d, int i)
+{
+	return d[i] | d[i + 1] << 8 | d[i + 2] << 16 | (u32)d[i + 3] << 24;
+}
+
+/* Replay a FSE script into the (reg, val, mask) accesses it does, decoding
+ * every opcode the way FSE_parse_opcode does, including the register, value
+ * and mask state of the compact forms. Nothing is executed: no delay, the
+ * jumps are not taken and the loops run once.
+ */
+static u32
+bench_FSE_walk(const u8 *d, int len)
+{
+	u32 reg = 0xffffffff, val = 0xffffffff, mask = 0xffffffff, sum = 0;
+	int i = 0;
+
+	while (i < len) {
+		u8 op = d[i++];
+
+		switch (op) {
+		case 0x00:
+			sum += bench_le32(d, i) ^ bench_le32(d, i + 4);
+			i += 8;
+			break;
+		case 0x01:
+		case 0x02:
+			sum += bench_le16(d, i);
+			i += 2;
+			break;
+		case 0x10:
+		case 0x11:
+		case 0x14:
+		case 0x15:
+		case 0x16:
+			/* write */
+			if (op == 0x10 || op == 0x11) {
+				reg = bench_le32(d, i);
+				i += 4;
+			} else {
+				reg = (reg & 0xffff0000) | bench_le16(d, i);
+				i += 2;
+			}
+
+			if (op == 0x11 || op == 0x15) {
+				val = d[i];
+				i += 1;
+			} else if (op == 0x16) {
+				val = (val & 0xffff0000) | bench_le16(d, i);
+				i += 2;
+			} else {
+				val = bench_le32(d, i);
+				i += 4;
+			}
+			sum += reg ^ val;
+			break;
+		case 0x12:
+		case 0x13:
+		case 0x17:
+		case 0x18:
+		case 0x19:
+		case 0x1a:
+			/* mask and wait */
+			if (op == 0x12 || op == 0x13) {
+				reg = bench_le32(d, i);
+				i += 4;
+			} else {
+				reg = (reg & 0xffff0000) | bench_le16(d, i);
+				i += 2;
+			}
+
+			if (op != 0x19 && op != 0x1a) {
+				mask = bench_le32(d, i);
+				i += 4;
+			}
+			val = bench_le32(d, i);
+			i += 4;
+			sum += reg ^ (val & mask);
+			break;
+		case 0x20:
+			/* send_msg: u16 size, payload */
+			i += 2 + bench_le16(d, i);
+			break;
+		case 0x30:
+		case 0x33:
+			i += 2;
+			break;
+		case 0x31:
+			i += 6;
+			break;
+		case 0x32:
+			sum += bench_le32(d, i) ^ bench_le32(d, i + 8);
+			i += 14;
+			break;
+		case 0xff:
+			return sum;
+		default:
+			return 0;
+		}
+	}
+
+	return sum;
+}
+
+/* decode a FSE script, as PDAEMON does once it is in its slot */
+static void
+bench_FSE_decode(void)
+{
+	bench_sink = bench_FSE_walk(bench_FSE.ptr.u08, bench_FSE.len);
+}
+
+/* what a compressed submission costs to decode: unpack then decode */
+static void
+bench_FSE_lz_decode(void)
+{
+	int len = FSE_lz_decompress(bench_lz, bench_lz_len, bench_buf, sizeof(bench_buf));
+
+	bench_sink = bench_FSE_walk(bench_buf, len);
+}
+
+/* replay a hwsq script into the (reg, val) pairs it writes */
+static void
+bench_hwsq_decode(void)
+{
+	const u8 *d = bench_hwsq.ptr.u08;
+	u32 reg = 0, val = 0, sum = 0;
+	int i = 0;
+
+	while (i < bench_hwsq.len) {
+		u8 op = d[i++];
+
+		switch (op) {
+		case 0x42:
+			val = (val & 0xffff0000) | d[i] | d[i + 1] << 8;
+			i += 2;
+			break;
+		case 0xe2:
+			val = d[i] | d[i + 1] << 8 | d[i + 2] << 16 | (u32)d[i + 3] << 24;
+			i += 4;
+			break;
+		case 0x40:
+			reg = (reg & 0xffff0000) | d[i] | d[i + 1] << 8;
+			i += 2;
+			sum += reg ^ val;
+			break;
+		case 0xe0:
+			reg = d[i] | d[i + 1] << 8 | d[i + 2] << 16 | (u32)d[i + 3] << 24;
+			i += 4;
+			sum += reg ^ val;
+			break;
+		case 0x5f:
+			i += 2;
+			break;
+		default:
+			/* usec, setf and exit are single bytes */
+			break;
+		}
+	}
+
+	bench_sink = sum;
+}
+
+static void
+bench_FSE_lz_compress(void)
+{
+	bench_sink = FSE_lz_compress(bench_FSE.ptr.u08, bench_FSE.len,
+				     bench_buf, sizeof(bench_buf));
+}
+
+static void
+bench_FSE_lz_decompress(void)
+{
+	bench_sink = FSE_lz_decompress(bench_lz, bench_lz_len,
+				       bench_buf, sizeof(bench_buf));
+}
+
+static void
+bench_data_segment_upload(void)
+{
+	data_segment_upload_u8(0, 0x1000, bench_buf, 0x100);
+}
+
+static void
+bench_data_segment_read(void)
+{
+	data_segment_read(0, 0x1000, 0x100, bench_buf);
+	bench_sink = bench_buf[0];
+}
+
+/* a whole round trip: send a resource get, wait for it, read it back */
+static void
+bench_resource_get(void)
+{
+	struct pdaemon_resource_command cmd;
+	uint8_t buf[16];
+
+	cmd = pdaemon_resource_get_set(0, PDAEMON_TEMP_PID, get, 0, buf, sizeof(buf));
+	pdaemon_read_resource(0, &cmd, buf);
+	bench_sink = buf[0];
+}
+
+static void
+bench_temp_history(void)
+{
+	struct pdaemon_temp_sample samples[PDAEMON_TEMP_HIST_SIZE];
+
+	bench_sink = pdaemon_temp_history(0, samples);
+}
+
+static void
+bench_FSE_submit(void)
+{
+	uint8_t slot;
+	uint32_t seq;
+
+	seq = pdaemon_FSE_submit(0, bench_FSE.ptr.u08, bench_FSE.len, 0, &slot);
+	pdaemon_FSE_sync(0, slot, seq);
+}
+
+static void
+bench_FSE_submit_lz(void)
+{
+	uint8_t slot;
+	uint32_t seq;
+
+	seq = pdaemon_FSE_submit_lz(0, bench_FSE.ptr.u08, bench_FSE.len, 0, &slot);
+	pdaemon_FSE_sync(0, slot, seq);
+}
+
+static void
+bench_rdispatch_read_msg(void)
+{
+	static const uint8_t payload[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	struct rdispatch_msg msg;
+
+	/* PDAEMON's side is not part of the measure, it does not touch BAR0 */
+	bar0_sim_rfifo_push(2, 1, sizeof(payload), payload);
+	rdispatch_read_msg(0, &msg);
+	bench_sink = msg.payload_size;
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "FSE_encode", 1000, bench_FSE_encode },
+	{ "hwsq_encode", 1000, bench_hwsq_encode },
+	{ "FSE_validate", 1000, bench_FSE_validate },
+	{ "FSE_decode", 1000, bench_FSE_decode },
+	{ "hwsq_decode", 1000, bench_hwsq_decode },
+	{ "FSE_lz_compress", 100, bench_FSE_lz_compress },
+	{ "FSE_lz_decompress", 1000, bench_FSE_lz_decompress },
+	{ "FSE_lz_decode", 1000, bench_FSE_lz_decode },
+	{ "data_segment_upload_u8/256", 100, bench_data_segment_upload },
+	{ "data_segment_read/256", 100, bench_data_segment_read },
+	{ "pdaemon_resource_get/16", 100, bench_resource_get },
+	{ "pdaemon_temp_history", 100, bench_temp_history },
+	{ "pdaemon_FSE_submit", 100, bench_FSE_submit },
+	{ "pdaemon_FSE_submit_lz", 100, bench_FSE_submit_lz },
+	{ "rdispatch_read_msg/8", 100, bench_rdispatch_read_msg },
+};
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of a sorted array */
+static double
+bench_percentile(const double *sorted, int n, double p)
+{
+	int rank = (int)(p * n);
+
+	if (rank < p * n)
+		rank++;
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1];
+}
+
+static void
+bench_run(const struct bench_case *c, struct bench_result *r)
+{
+	double samples[BENCH_MAX_REPS];
+	uint64_t rd, wr, start;
+	int rep, i;
+
+	for (rep = 0; rep < bench_warmup; rep++)
+		for (i = 0; i < c->batch; i++)
+			c->run();
+
+	rd = bar0_sim.rd;
+	wr = bar0_sim.wr;
+	for (rep = 0; rep < bench_reps; rep++) {
+		start = bench_now();
+		for (i = 0; i < c->batch; i++)
+			c->run();
+		samples[rep] = (double)(bench_now() - start) / c->batch;
+	}
+	qsort(samples, bench_reps, sizeof(*samples), bench_cmp_double);
+
+	snprintf(r->name, sizeof(r->name), "%s", c->name);
+	r->p50 = bench_percentile(samples, bench_reps, 0.50);
+	r->p90 = bench_percentile(samples, bench_reps, 0.90);
+	r->p99 = bench_percentile(samples, bench_reps, 0.99);
+	r->ops = r->p50 > 0 ? 1e9 / r->p50 : 0;
+	r->mmio_rd = (double)(bar0_sim.rd - rd) / ((uint64_t)bench_reps * c->batch);
+	r->mmio_wr = (double)(bar0_sim.wr - wr) / ((uint64_t)bench_reps * c->batch);
+}
+
+static void
+bench_write(FILE *f, const struct bench_result *r, int count)
+{
+	int i;
+
+	fprintf(f, "# name ops/s p50_ns p90_ns p99_ns mmio_rd mmio_wr\n");
+	for (i = 0; i < count; i++)
+		fprintf(f, "%s %.0f %.1f %.1f %.1f %.3f %.3f\n", r[i].name, r[i].ops,
+			r[i].p50, r[i].p90, r[i].p99, r[i].mmio_rd, r[i].mmio_wr);
+}
+
+static int
+bench_read(const char *path, struct bench_result *r, int max)
+{
+	char line[256];
+	FILE *f = fopen(path, "r");
+	int count = 0;
+
+	if (!f)
+		return -1;
+
+	while (count < max && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %lf %lf %lf %lf %lf %lf", r[count].name,
+			   &r[count].ops, &r[count].p50, &r[count].p90, &r[count].p99,
+			   &r[count].mmio_rd, &r[count].mmio_wr) == 7)
+			count++;
+	}
+	fclose(f);
+
+	return count;
+}
+
+/* returns the number of regressions */
+static int
+bench_compare(FILE *f, const struct bench_result *r, int count,
+	      const struct bench_result *base, int base_count,
+	      double time_threshold, double mmio_threshold)
+{
+	int i, j, fails = 0;
+
+	for (i = 0; i < count; i++) {
+		double mmio, base_mmio;
+
+		for (j = 0; j < base_count; j++) {
+			if (!strcmp(r[i].name, base[j].name))
+				break;
+		}
+		if (j == base_count) {
+			fprintf(f, "NEW  %s\n", r[i].name);
+			continue;
+		}
+
+		if (time_threshold >= 0 &&
+		    r[i].p50 > base[j].p50 * (1 + time_threshold)) {
+			fprintf(f, "FAIL %s: p50 %.1fns, baseline %.1fns (+%.0f%%)\n",
+				r[i].name, r[i].p50, base[j].p50,
+				(r[i].p50 / base[j].p50 - 1) * 100);
+			fails++;
+		}
+
+		mmio = r[i].mmio_rd + r[i].mmio_wr;
+		base_mmio = base[j].mmio_rd + base[j].mmio_wr;
+		/* the counts are averages, rounded when stored */
+		if (mmio > base_mmio * (1 + mmio_threshold) + 0.002) {
+			fprintf(f, "FAIL %s: %.2f MMIO accesses, baseline %.2f\n",
+				r[i].name, mmio, base_mmio);
+			fails++;
+		}
+	}
+
+	return fails;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_result results[BENCH_MAX_CASES], base[BENCH_MAX_CASES];
+	const char *out_path = NULL, *base_path = NULL, *save_path = NULL;
+	double time_threshold = -1, mmio_threshold = 0;
+	int count = sizeof(bench_cases) / sizeof(*bench_cases);
+	int base_count, fails = 0, i, c;
+	FILE *out, *f;
+
+	while ((c = getopt(argc, argv, "o:b:s:T:M:r:")) != -1)
+		switch (c) {
+			case 'o':
+				out_path = optarg;
+				break;
+			case 'b':
+				base_path = optarg;
+				break;
+			case 's':
+				save_path = optarg;
+				break;
+			case 'T':
+				time_threshold = atof(optarg);
+				break;
+			case 'M':
+				mmio_threshold = atof(optarg);
+				break;
+			case 'r':
+				bench_reps = atoi(optarg);
+				if (bench_reps < 1 || bench_reps > BENCH_MAX_REPS) {
+					fprintf(stderr, "repetitions must be in [1, %i]\n",
+						BENCH_MAX_REPS);
+					return 1;
+				}
+				break;
+		}
+
+	/* run.c logs to stdout, keep it away from the results */
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "Cannot redirect stdout\n");
+		return 1;
+	}
+
+	nva_init();
+
+	/* all the pids are handled by the core, no overlay to load */
+	pdaemon_data = (uint32_t *)bar0_sim.data;
+	memset(bar0_sim.data + PDAEMON_CORE_PID_OVL, PDAEMON_OVL_NONE, 16);
+
+	bench_build_FSE(&bench_FSE);
+	bench_build_hwsq(&bench_hwsq);
+	bench_lz_len = FSE_lz_compress(bench_FSE.ptr.u08, bench_FSE.len,
+				       bench_lz, sizeof(bench_lz));
+
+	for (i = 0; i < count; i++)
+		bench_run(&bench_cases[i], &results[i]);
+
+	bench_write(out, results, count);
+
+	if (out_path) {
+		f = fopen(out_path, "w");
+		if (!f) {
+			fprintf(stderr, "Cannot open %s\n", out_path);
+			return 1;
+		}
+		bench_write(f, results, count);
+		fclose(f);
+	}
+
+	if (base_path) {
+		base_count = bench_read(base_path, base, BENCH_MAX_CASES);
+		if (base_count < 0) {
+			fprintf(stderr, "Cannot read %s\n", base_path);
+			return 1;
+		}
+		fails = bench_compare(out, results, count, base, base_count,
+				      time_threshold, mmio_threshold);
+		fprintf(out, "%i regression(s) against %s\n", fails, base_path);
+	}
+
+	if (save_path) {
+		f = fopen(save_path, "w");
+		if (!f) {
+			fprintf(stderr, "Cannot open %s\n", save_path);
+			return 1;
+		}
+		bench_write(f, results, count);
+		fclose(f);
+	}
+
+	fclose(out);
+
+	return fails ? 1 : 0;
+}
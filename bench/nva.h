@@ -0,0 +1,215 @@
+/*
+ * Simulated BAR0 for the benchmarks.
+ *
+ * Stands in for envytools' nva.h so as run.c can be built and driven without
+ * a card. It models just enough of PDAEMON (see the memory map in pdaemon.fuc)
+ * for the host paths to complete:
+ * - the data segment port (0x10a1c8/0x10a1cc), backed by bar0_sim.data
+ * - the code segment port (0x10a180-0x10a188), the code is dropped
+ * - the dispatch FIFO: the commands are executed as soon as PUT is written.
+ * 	core/temp_mgmt resources are copied, FSE scripts are not run but their
+ * 	slot fence is set right away.
+ * - the RFIFO GET/PUT registers, bar0_sim_rfifo_push adds messages
+ * Every access is counted in bar0_sim.rd and bar0_sim.wr.
+ */
+
+#ifndef __BENCH_NVA_H__
+#define __BENCH_NVA_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define BAR0_SIM_DATA_SIZE 0x4000
+
+/* pdaemon.fuc's memory map */
+#define BAR0_SIM_CORE 0x400
+#define BAR0_SIM_DISPATCH_FENCE 0x500
+#define BAR0_SIM_DISPATCH_RING 0x550
+#define BAR0_SIM_RDISPATCH_RING 0xa00
+#define BAR0_SIM_RDISPATCH_SIZE 0x100
+#define BAR0_SIM_TEMP 0xb00
+#define BAR0_SIM_FSE_SLOT_FENCE 0xc1c
+
+struct nva_card {
+	int chipset;
+};
+
+static struct nva_card nva_cards[1] = { { 0xa3 } };
+static int nva_cardsnum = 1;
+
+struct bar0_sim {
+	uint8_t data[BAR0_SIM_DATA_SIZE];
+	uint32_t data_port;
+
+	uint32_t fifo_put;
+	uint32_t fifo_get;
+	uint32_t rfifo_put;
+	uint32_t rfifo_get;
+
+	uint64_t rd;
+	uint64_t wr;
+};
+
+static struct bar0_sim bar0_sim;
+
+static inline uint32_t
+bar0_sim_ld32(uint32_t addr)
+{
+	uint32_t val;
+
+	memcpy(&val, &bar0_sim.data[addr % BAR0_SIM_DATA_SIZE], 4);
+	return val;
+}
+
+static inline void
+bar0_sim_st32(uint32_t addr, uint32_t val)
+{
+	memcpy(&bar0_sim.data[addr % BAR0_SIM_DATA_SIZE], &val, 4);
+}
+
+/* what PDAEMON's dispatch would do with a command */
+static inline void
+bar0_sim_exec(uint32_t entry)
+{
+	uint32_t pid = entry >> 28;
+	uint32_t ptr = (entry & 0xffff) % BAR0_SIM_DATA_SIZE;
+	uint32_t header = bar0_sim_ld32(ptr);
+	uint32_t base, id, size;
+
+	switch (pid) {
+	case 0:
+	case 1:
+		/* resource get/set: u1 set, u15 size, u16 id */
+		base = pid == 0 ? BAR0_SIM_CORE : BAR0_SIM_TEMP;
+		id = header & 0xffff;
+		size = (header >> 16) & 0x7fff;
+		if (ptr + 4 + size > BAR0_SIM_DATA_SIZE ||
+		    base + id + size > BAR0_SIM_DATA_SIZE)
+			break;
+
+		if (header & 0x80000000)
+			memmove(&bar0_sim.data[base + id], &bar0_sim.data[ptr + 4], size);
+		else
+			memmove(&bar0_sim.data[ptr + 4], &bar0_sim.data[base + id], size);
+		break;
+	case 2:
+		/* FSE: u8 cmd, u8 slot, u16 size, u32 seq. Done right away. */
+		bar0_sim_st32(BAR0_SIM_FSE_SLOT_FENCE + ((header >> 8) & 0xff) * 4,
+			      bar0_sim_ld32(ptr + 4));
+		break;
+	}
+
+	bar0_sim_st32(BAR0_SIM_DISPATCH_FENCE,
+		      bar0_sim_ld32(BAR0_SIM_DISPATCH_FENCE) + 1);
+}
+
+static inline void
+bar0_sim_dispatch(void)
+{
+	while (bar0_sim.fifo_get != bar0_sim.fifo_put) {
+		bar0_sim_exec(bar0_sim_ld32(bar0_sim.fifo_get));
+		bar0_sim.fifo_get = BAR0_SIM_DISPATCH_RING +
+			(bar0_sim.fifo_get - BAR0_SIM_DISPATCH_RING + 4) % 0x40;
+	}
+}
+
+static inline void
+bar0_sim_rfifo_put8(uint8_t val)
+{
+	bar0_sim.data[bar0_sim.rfifo_put] = val;
+	bar0_sim.rfifo_put = BAR0_SIM_RDISPATCH_RING +
+		(bar0_sim.rfifo_put + 1 - BAR0_SIM_RDISPATCH_RING) % BAR0_SIM_RDISPATCH_SIZE;
+}
+
+/* queue a PDAEMON -> host message, as rdispatch_send_msg would */
+static inline void
+bar0_sim_rfifo_push(uint8_t pid, uint8_t msg_id, uint8_t size, const uint8_t *payload)
+{
+	uint32_t i;
+
+	bar0_sim_rfifo_put8(pid);
+	bar0_sim_rfifo_put8(msg_id);
+	bar0_sim_rfifo_put8(size);
+	for (i = 0; i < size; i++)
+		bar0_sim_rfifo_put8(payload[i]);
+}
+
+static inline int
+nva_init(void)
+{
+	memset(&bar0_sim, 0, sizeof(bar0_sim));
+	bar0_sim.fifo_put = bar0_sim.fifo_get = BAR0_SIM_DISPATCH_RING;
+	bar0_sim.rfifo_put = bar0_sim.rfifo_get = BAR0_SIM_RDISPATCH_RING;
+
+	return 0;
+}
+
+static inline uint32_t
+nva_rd32(int cnum, uint32_t reg)
+{
+	uint32_t val = 0;
+
+	bar0_sim.rd++;
+
+	switch (reg) {
+	case 0x10a1cc:
+		val = bar0_sim_ld32(bar0_sim.data_port & 0xfffc);
+		if (bar0_sim.data_port & 0x02000000)
+			bar0_sim.data_port += 4;
+		break;
+	case 0x10a108:
+		/* 0x4000 bytes of code, 0x4000 bytes of data */
+		val = 0x40 | (0x40 << 9);
+		break;
+	case 0x10a4a0:
+		val = bar0_sim.fifo_put;
+		break;
+	case 0x10a4b0:
+		val = bar0_sim.fifo_get;
+		break;
+	case 0x10a4c8:
+		val = bar0_sim.rfifo_put;
+		break;
+	case 0x10a4cc:
+		val = bar0_sim.rfifo_get;
+		break;
+	}
+
+	return val;
+}
+
+static inline void
+nva_wr32(int cnum, uint32_t reg, uint32_t val)
+{
+	bar0_sim.wr++;
+
+	switch (reg) {
+	case 0x10a1c8:
+		bar0_sim.data_port = val;
+		break;
+	case 0x10a1cc:
+		bar0_sim_st32(bar0_sim.data_port & 0xfffc, val);
+		if (bar0_sim.data_port & 0x01000000)
+			bar0_sim.data_port += 4;
+		break;
+	case 0x10a4a0:
+		bar0_sim.fifo_put = val;
+		bar0_sim_dispatch();
+		break;
+	case 0x10a4cc:
+		bar0_sim.rfifo_get = val;
+		break;
+	}
+}
+
+static inline uint32_t
+nva_mask(int cnum, uint32_t reg, uint32_t mask, uint32_t val)
+{
+	uint32_t tmp = nva_rd32(cnum, reg);
+
+	nva_wr32(cnum, reg, (tmp & ~mask) | val);
+
+	return tmp;
+}
+
+#endif
@@ -0,0 +1,3 @@
+/* Stand-in for the envyas output, the benchmarks never upload the firmware */
+uint32_t nvd9_pdaemon_data[0x1200 / 4];
+uint32_t nvd9_pdaemon_code[0x100];
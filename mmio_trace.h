@@ -0,0 +1,303 @@
+/*
+ * MMIO timeline tracer for host <-> PDAEMON sessions.
+ *
+ * Records every BAR0 access with its timestamp, register, value and the
+ * operation (span) it belongs to, then exports them as Chrome-trace JSON
+ * (chrome://tracing, ui.perfetto.dev) and prints a per-operation summary.
+ *
+ * Usage: include it after nva.h, then redirect the accessors:
+ *	#define nva_rd32 mmio_trace_rd32
+ *	#define nva_wr32 mmio_trace_wr32
+ *	#define nva_mask mmio_trace_mask
+ * Nothing is recorded until mmio_trace_start() is called.
+ *
+ * Spans are opened/closed with mmio_trace_span_begin/end and can be nested.
+ * Busy-wait loops should call mmio_trace_spin() once per re-poll, i.e. not
+ * when the condition is already met on the first read.
+ * Reads are counted as round trips (they stall on PCIe), writes are posted.
+ */
+
+#ifndef __MMIO_TRACE_H__
+#define __MMIO_TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MMIO_TRACE_NO_SPAN 0xffffffff
+
+struct mmio_trace_access {
+	uint64_t ts;	/* ns, relative to mmio_trace_start() */
+	uint32_t dur;	/* ns */
+	uint32_t reg;
+	uint32_t val;
+	uint32_t span;
+	uint8_t write;
+};
+
+struct mmio_trace_span {
+	const char *name;
+	uint64_t begin;
+	uint64_t end;
+	uint32_t parent;
+
+	/* accesses done in this span, nested spans excluded */
+	uint32_t rd;
+	uint32_t wr;
+	uint32_t spins;
+	uint64_t mmio_ns;
+};
+
+struct mmio_trace_state {
+	int enabled;
+	uint64_t t0;
+	uint32_t cur_span;
+
+	struct mmio_trace_access *acc;
+	size_t acc_len, acc_size;
+
+	struct mmio_trace_span *spans;
+	size_t spans_len, spans_size;
+};
+
+static struct mmio_trace_state mmio_trace = { 0, 0, MMIO_TRACE_NO_SPAN };
+
+static inline uint64_t
+mmio_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec - mmio_trace.t0;
+}
+
+/* grow *array so as it can hold one more element, 0 on failure */
+static inline int
+mmio_trace_grow(void **array, size_t *size, size_t len, size_t elem_size)
+{
+	void *tmp;
+
+	if (len < *size)
+		return 1;
+
+	tmp = realloc(*array, (*size ? *size * 2 : 4096) * elem_size);
+	if (!tmp)
+		return 0;
+
+	*array = tmp;
+	*size = *size ? *size * 2 : 4096;
+	return 1;
+}
+
+static inline void
+mmio_trace_start(void)
+{
+	mmio_trace.t0 = 0;
+	mmio_trace.t0 = mmio_trace_now();
+	mmio_trace.cur_span = MMIO_TRACE_NO_SPAN;
+	mmio_trace.acc_len = 0;
+	mmio_trace.spans_len = 0;
+	mmio_trace.enabled = 1;
+}
+
+static inline void
+mmio_trace_stop(void)
+{
+	mmio_trace.enabled = 0;
+	free(mmio_trace.acc);
+	free(mmio_trace.spans);
+	memset(&mmio_trace, 0, sizeof(mmio_trace));
+	mmio_trace.cur_span = MMIO_TRACE_NO_SPAN;
+}
+
+static inline void
+mmio_trace_span_begin(const char *name)
+{
+	struct mmio_trace_span *span;
+
+	if (!mmio_trace.enabled ||
+	    !mmio_trace_grow((void **)&mmio_trace.spans, &mmio_trace.spans_size,
+			     mmio_trace.spans_len, sizeof(*mmio_trace.spans)))
+		return;
+
+	span = &mmio_trace.spans[mmio_trace.spans_len];
+	memset(span, 0, sizeof(*span));
+	span->name = name;
+	span->parent = mmio_trace.cur_span;
+	span->begin = mmio_trace_now();
+	span->end = span->begin;
+
+	mmio_trace.cur_span = mmio_trace.spans_len++;
+}
+
+static inline void
+mmio_trace_span_end(void)
+{
+	struct mmio_trace_span *span;
+
+	if (!mmio_trace.enabled || mmio_trace.cur_span == MMIO_TRACE_NO_SPAN)
+		return;
+
+	span = &mmio_trace.spans[mmio_trace.cur_span];
+	span->end = mmio_trace_now();
+	mmio_trace.cur_span = span->parent;
+}
+
+static inline void
+mmio_trace_spin(void)
+{
+	if (mmio_trace.enabled && mmio_trace.cur_span != MMIO_TRACE_NO_SPAN)
+		mmio_trace.spans[mmio_trace.cur_span].spins++;
+}
+
+static inline void
+mmio_trace_record(uint64_t ts, uint32_t reg, uint32_t val, uint8_t write)
+{
+	struct mmio_trace_access *acc;
+	uint64_t end = mmio_trace_now();
+
+	if (!mmio_trace_grow((void **)&mmio_trace.acc, &mmio_trace.acc_size,
+			     mmio_trace.acc_len, sizeof(*mmio_trace.acc)))
+		return;
+
+	acc = &mmio_trace.acc[mmio_trace.acc_len++];
+	acc->ts = ts;
+	acc->dur = end - ts;
+	acc->reg = reg;
+	acc->val = val;
+	acc->span = mmio_trace.cur_span;
+	acc->write = write;
+
+	if (mmio_trace.cur_span != MMIO_TRACE_NO_SPAN) {
+		struct mmio_trace_span *span = &mmio_trace.spans[mmio_trace.cur_span];
+
+		if (write)
+			span->wr++;
+		else
+			span->rd++;
+		span->mmio_ns += acc->dur;
+	}
+}
+
+static inline uint32_t
+mmio_trace_rd32(int cnum, uint32_t reg)
+{
+	uint64_t ts;
+	uint32_t val;
+
+	if (!mmio_trace.enabled)
+		return nva_rd32(cnum, reg);
+
+	ts = mmio_trace_now();
+	val = nva_rd32(cnum, reg);
+	mmio_trace_record(ts, reg, val, 0);
+
+	return val;
+}
+
+static inline void
+mmio_trace_wr32(int cnum, uint32_t reg, uint32_t val)
+{
+	uint64_t ts;
+
+	if (!mmio_trace.enabled) {
+		nva_wr32(cnum, reg, val);
+		return;
+	}
+
+	ts = mmio_trace_now();
+	nva_wr32(cnum, reg, val);
+	mmio_trace_record(ts, reg, val, 1);
+}
+
+static inline uint32_t
+mmio_trace_mask(int cnum, uint32_t reg, uint32_t mask, uint32_t val)
+{
+	uint32_t tmp = mmio_trace_rd32(cnum, reg);
+
+	mmio_trace_wr32(cnum, reg, (tmp & ~mask) | val);
+
+	return tmp;
+}
+
+/* Chrome trace event format, timestamps in µs */
+static inline void
+mmio_trace_write_json(FILE *f)
+{
+	size_t i;
+	int first = 1;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+	for (i = 0; i < mmio_trace.spans_len; i++) {
+		struct mmio_trace_span *span = &mmio_trace.spans[i];
+
+		fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"op\", \"ph\": \"X\", "
+			"\"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, "
+			"\"args\": {\"rd\": %u, \"wr\": %u, \"spins\": %u}}",
+			first ? "" : ",\n", span->name, span->begin / 1000.0,
+			(span->end - span->begin) / 1000.0, span->rd, span->wr,
+			span->spins);
+		first = 0;
+	}
+
+	for (i = 0; i < mmio_trace.acc_len; i++) {
+		struct mmio_trace_access *acc = &mmio_trace.acc[i];
+
+		fprintf(f, "%s{\"name\": \"%s 0x%06x\", \"cat\": \"mmio\", \"ph\": \"X\", "
+			"\"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, "
+			"\"args\": {\"reg\": \"0x%06x\", \"val\": \"0x%08x\"}}",
+			first ? "" : ",\n", acc->write ? "wr32" : "rd32", acc->reg,
+			acc->ts / 1000.0, acc->dur / 1000.0, acc->reg, acc->val);
+		first = 0;
+	}
+
+	fprintf(f, "\n]}\n");
+}
+
+/* aggregate the spans by name */
+static inline void
+mmio_trace_summary(FILE *f)
+{
+	size_t i, j;
+
+	fprintf(f, "%-28s %6s %12s %12s %8s %8s %8s\n", "operation", "calls",
+		"total(us)", "mmio(us)", "rd", "wr", "spins");
+
+	for (i = 0; i < mmio_trace.spans_len; i++) {
+		const char *name = mmio_trace.spans[i].name;
+		uint64_t total = 0, mmio = 0, rd = 0, wr = 0, spins = 0, calls = 0;
+
+		/* already reported? */
+		for (j = 0; j < i; j++) {
+			if (!strcmp(mmio_trace.spans[j].name, name))
+				break;
+		}
+		if (j < i)
+			continue;
+
+		for (j = i; j < mmio_trace.spans_len; j++) {
+			struct mmio_trace_span *span = &mmio_trace.spans[j];
+
+			if (strcmp(span->name, name))
+				continue;
+
+			calls++;
+			total += span->end - span->begin;
+			mmio += span->mmio_ns;
+			rd += span->rd;
+			wr += span->wr;
+			spins += span->spins;
+		}
+
+		fprintf(f, "%-28s %6llu %12.1f %12.1f %8llu %8llu %8llu\n", name,
+			(unsigned long long)calls, total / 1000.0, mmio / 1000.0,
+			(unsigned long long)rd, (unsigned long long)wr,
+			(unsigned long long)spins);
+	}
+	fprintf(f, "%zu MMIO accesses recorded\n", mmio_trace.acc_len);
+}
+
+#endif
@@ -1,20 +1,80 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <string.h>
 #include "nva.h"
 #include "nva3_pdaemon.fuc.h"
 #include "nvd9_pdaemon.fuc.h"
+#include "mmio_trace.h"
+#include "FSE_lz.h"
+
+/* every BAR0 access goes through the tracer, see -t */
+#define nva_rd32 mmio_trace_rd32
+#define nva_wr32 mmio_trace_wr32
+#define nva_mask mmio_trace_mask
 
 typedef uint64_t ptime_t;
 
 typedef enum { false = 0, true = 1} bool;
 typedef enum { get = 0, set = 1} resource_op;
-
+typedef enum { FSE_done = 0, FSE_rejected, FSE_timeout, FSE_failed } FSE_status;
+
+#define PDAEMON_CORE_ISR_LATENCY_LAST 0x0000041c
+#define PDAEMON_CORE_ISR_LATENCY_MAX 0x00000420
+#define PDAEMON_CORE_OVL_RESIDENT 0x00000424
+#define PDAEMON_CORE_OVL_BUSY 0x00000428
+#define PDAEMON_CORE_OVL_TABLE 0x0000042c
+#define PDAEMON_CORE_PID_OVL 0x00000434
 #define PDAEMON_DISPATCH_FENCE 0x00000500
+#define PDAEMON_DISPATCH_DROP_FENCE 0x00000504
 #define PDAEMON_DISPATCH_RING 0x00000550
 #define PDAEMON_DISPATCH_DATA 0x00000590
 #define PDAEMON_DISPATCH_DATA_SIZE 0x00000370
 #define RDISPATCH_SIZE 0x00000100
+#define PDAEMON_TEMP_PID 1
+#define PDAEMON_TEMP_NAME 0x00000b00
+#define PDAEMON_TEMP_PWM_ID 0x00000b28
+#define PDAEMON_TEMP_FAN_MODE 0x00000b2e
+#define PDAEMON_TEMP_HIST_COUNT 0x00000b40
+#define PDAEMON_TEMP_HIST 0x00000b48
+#define PDAEMON_TEMP_HIST_SIZE 16
+#define PDAEMON_TEMP_TABLE 0x00001100
+#define PDAEMON_TEMP_TABLE_SIZE 128
+#define PDAEMON_TEMP_MODE_TABLE 4
+#define PDAEMON_FSE_SLOT_FENCE 0x00000c1c
+#define PDAEMON_FSE_SLOTS 0x00000d00
+#define PDAEMON_FSE_SLOT_SIZE 0x200
+#define PDAEMON_FSE_SLOT_COUNT 2
+#define PDAEMON_FSE_PID 2
+#define PDAEMON_FSE_CMD_QUEUE 1
+#define PDAEMON_FSE_CMD_QUEUE_LZ 2
+#define PDAEMON_FSE_LZ_UNPACK_TIME 0x00000c34
+#define PDAEMON_FSE_ERROR_SEQ 0x00000c38
+#define PDAEMON_FSE_TIMEOUT_SLACK 1000000000ULL /* ns, on top of the scripts' own */
+#define PDAEMON_FSE_LZ_SIZE (PDAEMON_DISPATCH_DATA_SIZE - 8)
+
+#define PDAEMON_CODE_PAGE_SIZE 0x100
+#define PDAEMON_CODE_VIRT_PAGES 0x100 /* core_ovl_table holds 16-bit addresses */
+#define PDAEMON_OVL_COUNT 2
+#define PDAEMON_OVL_NONE 0xff
+#define PDAEMON_OVL_FSE 0
+#define PDAEMON_OVL_FAN 1
+#define PDAEMON_OVL_EVICT_TIMEOUT 1000000000ULL /* ns */
+
+struct pdaemon_overlay {
+	/* virtual code range [begin, end[, page-aligned */
+	uint16_t code_begin;
+	uint16_t code_end;
+
+	/* first physical code page the overlay is uploaded to */
+	uint16_t phys_page;
+	bool resident;
+};
+
+static struct pdaemon_overlay pdaemon_ovl[PDAEMON_OVL_COUNT];
+static uint32_t pdaemon_ovl_resident_mask = 0;
+static uint32_t *pdaemon_code = NULL;
+static uint32_t *pdaemon_data = NULL;
 
 #define NV04_PTIMER_TIME_0                                 0x00009400
 #define NV04_PTIMER_TIME_1                                 0x00009410
@@ -112,11 +172,184 @@ static void data_segment_upload_u8(unsigned int cnum, uint16_t base,
 	nva_wr32(cnum, 0x10a1cc, tmp);
 }
 
-static void pdaemon_upload(unsigned int cnum) {
+static void code_segment_upload(unsigned int cnum, uint16_t phys_page,
+				uint16_t virt_page, uint32_t *code, uint32_t length)
+{
+	uint32_t i;
+
+	nva_wr32(cnum, 0x10a180, 0x01000000 | (phys_page * PDAEMON_CODE_PAGE_SIZE));
+	for (i = 0; i < length; ++i) {
+		if (i % 64 == 0)
+			nva_wr32(cnum, 0x10a188, virt_page + (i >> 6));
+		nva_wr32(cnum, 0x10a184, code[i]);
+	}
+}
+
+/* Give every overlay a fixed physical home right after the resident code.
+ * When the overlays do not all fit, we wrap around and the overlays sharing
+ * some pages will evict each other. A virtual page is thus always uploaded
+ * to the same physical page and can never end up being tagged twice.
+ * Returns false if an overlay is malformed, lies outside of the code image
+ * or does not fit in the code pages left by the resident code.
+ */
+static bool pdaemon_ovl_init(uint16_t code_pages, uint32_t code_size)
+{
+	uint16_t resident_pages, next_page;
 	int i;
-	uint32_t code_size, max_code_size, max_data_size;
+
+	resident_pages = (pdaemon_data[PDAEMON_CORE_OVL_TABLE / 4] & 0xffff) / PDAEMON_CODE_PAGE_SIZE;
+	next_page = resident_pages;
+	pdaemon_ovl_resident_mask = 0;
+
+	if (resident_pages >= code_pages) {
+		fprintf(stderr, "pdaemon_ovl_init: the resident code (%i pages) "
+			"does not leave room for overlays (%i pages)\n",
+			resident_pages, code_pages);
+		return false;
+	}
+
+	for (i = 0; i < PDAEMON_OVL_COUNT; i++) {
+		struct pdaemon_overlay *ovl = &pdaemon_ovl[i];
+		uint32_t range = pdaemon_data[PDAEMON_CORE_OVL_TABLE / 4 + i];
+		uint16_t pages;
+
+		ovl->code_begin = range & 0xffff;
+		ovl->code_end = range >> 16;
+		ovl->resident = false;
+
+		if (ovl->code_begin % PDAEMON_CODE_PAGE_SIZE ||
+		    ovl->code_end % PDAEMON_CODE_PAGE_SIZE ||
+		    ovl->code_end <= ovl->code_begin ||
+		    ovl->code_end / PDAEMON_CODE_PAGE_SIZE > PDAEMON_CODE_VIRT_PAGES ||
+		    ovl->code_end > code_size * 4) {
+			fprintf(stderr, "pdaemon_ovl_init: overlay %i has an invalid "
+				"code range [0x%x, 0x%x[ (code image: 0x%x bytes)\n",
+				i, ovl->code_begin, ovl->code_end, code_size * 4);
+			return false;
+		}
+
+		pages = (ovl->code_end - ovl->code_begin) / PDAEMON_CODE_PAGE_SIZE;
+		if (pages > code_pages - resident_pages) {
+			fprintf(stderr, "pdaemon_ovl_init: overlay %i (%i pages) does "
+				"not fit in the %i code pages left\n",
+				i, pages, code_pages - resident_pages);
+			return false;
+		}
+
+		if (next_page + pages > code_pages)
+			next_page = resident_pages;
+		ovl->phys_page = next_page;
+		next_page += pages;
+	}
+
+	return true;
+}
+
+/* Returns false if PDAEMON does not leave the overlay within
+ * PDAEMON_OVL_EVICT_TIMEOUT, the overlay is then left resident.
+ */
+static bool pdaemon_ovl_evict(unsigned int cnum, uint8_t id)
+{
+	uint32_t busy;
+	ptime_t start = 0;
+	bool waiting = false;
+
+	/* tell PDAEMON the overlay is gone */
+	pdaemon_ovl_resident_mask &= ~(1 << id);
+	data_segment_upload_u32(cnum, PDAEMON_CORE_OVL_RESIDENT,
+				&pdaemon_ovl_resident_mask, 1);
+
+	/* then wait for it to leave it */
+	data_segment_read(cnum, PDAEMON_CORE_OVL_BUSY, 4, (uint8_t*)(&busy));
+	while (busy & (1 << id)) {
+		/* only read PTIMER once we actually have to wait */
+		if (!waiting) {
+			start = get_time(cnum);
+			waiting = true;
+		} else if (get_time(cnum) - start > PDAEMON_OVL_EVICT_TIMEOUT) {
+			fprintf(stderr, "pdaemon_ovl_evict: timeout, overlay %u is "
+				"still busy\n", id);
+			pdaemon_ovl_resident_mask |= (1 << id);
+			data_segment_upload_u32(cnum, PDAEMON_CORE_OVL_RESIDENT,
+						&pdaemon_ovl_resident_mask, 1);
+			return false;
+		}
+		mmio_trace_spin();
+		data_segment_read(cnum, PDAEMON_CORE_OVL_BUSY, 4, (uint8_t*)(&busy));
+	}
+
+	pdaemon_ovl[id].resident = false;
+
+	return true;
+}
+
+static bool pdaemon_ovl_load(unsigned int cnum, uint8_t id)
+{
+	struct pdaemon_overlay *ovl;
+	uint16_t pages;
+	int i;
+
+	if (id >= PDAEMON_OVL_COUNT)
+		return false;
+
+	ovl = &pdaemon_ovl[id];
+	if (ovl->resident)
+		return true;
+
+	mmio_trace_span_begin("pdaemon_ovl_load");
+
+	/* evict the overlays sharing some physical pages with this one */
+	pages = (ovl->code_end - ovl->code_begin) / PDAEMON_CODE_PAGE_SIZE;
+	for (i = 0; i < PDAEMON_OVL_COUNT; i++) {
+		struct pdaemon_overlay *o = &pdaemon_ovl[i];
+		uint16_t o_pages = (o->code_end - o->code_begin) / PDAEMON_CODE_PAGE_SIZE;
+
+		if (i == id || !o->resident)
+			continue;
+
+		if (o->phys_page < ovl->phys_page + pages &&
+		    ovl->phys_page < o->phys_page + o_pages &&
+		    !pdaemon_ovl_evict(cnum, i)) {
+			mmio_trace_span_end();
+			return false;
+		}
+	}
+
+	code_segment_upload(cnum, ovl->phys_page,
+			    ovl->code_begin / PDAEMON_CODE_PAGE_SIZE,
+			    pdaemon_code + ovl->code_begin / 4,
+			    (ovl->code_end - ovl->code_begin) / 4);
+
+	ovl->resident = true;
+	pdaemon_ovl_resident_mask |= (1 << id);
+	data_segment_upload_u32(cnum, PDAEMON_CORE_OVL_RESIDENT,
+				&pdaemon_ovl_resident_mask, 1);
+
+	/* ring the doorbell (SWGEN0) so as the work waiting on it runs now */
+	nva_wr32(cnum, 0x10a000, 0x40);
+
+	mmio_trace_span_end();
+
+	return true;
+}
+
+/* make sure the handler of a pid is uploaded before sending it a command */
+static bool pdaemon_ovl_load_pid(unsigned int cnum, uint8_t pid)
+{
+	uint8_t id = ((uint8_t *)pdaemon_data)[PDAEMON_CORE_PID_OVL + (pid & 0xf)];
+
+	if (id == PDAEMON_OVL_NONE)
+		return true;
+
+	return pdaemon_ovl_load(cnum, id);
+}
+
+static bool pdaemon_upload(unsigned int cnum) {
+	uint32_t code_size, resident_code_size, max_code_size, max_data_size;
 	uint32_t *code;
 
+	mmio_trace_span_begin("pdaemon_upload");
+
 	/* reboot PDAEMON */
 	if (nva_cards[cnum].chipset > 0xc0)
 		nva_mask(cnum, 0x200, 0x2000, 0);
@@ -129,41 +362,15 @@ static void pdaemon_upload(unsigned int cnum) {
 
 	/* data upload */
 	if (nva_cards[cnum].chipset < 0xd9) {
+		pdaemon_data = nva3_pdaemon_data;
 		data_segment_upload_u32(cnum, 0, nva3_pdaemon_data,
 			  sizeof(nva3_pdaemon_data)/sizeof(*nva3_pdaemon_data));
 	} else {
+		pdaemon_data = nvd9_pdaemon_data;
 		data_segment_upload_u32(cnum, 0, nvd9_pdaemon_data,
 			  sizeof(nvd9_pdaemon_data)/sizeof(*nvd9_pdaemon_data));
 	}
 
-	/* Writing test data to 0xd00 */
- 	uint8_t buffer[23];
-
-	buffer[0] = 0x20;
-	buffer[1] = 5;
-	buffer[2] = 15;
-	buffer[3] = 25;
-	buffer[4] = 36;
-	buffer[5] = 46;
-	buffer[6] = 56;/*
-	buffer[7] = 0x55;
-	buffer[8] = 0x55;
-	buffer[9] = 0x12;
-	buffer[10] = 0xd0;
-	buffer[11] = 0xa5;
-	buffer[12] = 0x10;
-	buffer[13] = 0x00;
-	buffer[14] = 0x33;
-	buffer[15] = 0x33;
-	buffer[16] = 0x33;
-	buffer[17] = 0x33;
-	buffer[18] = 0x0f;
-	buffer[19] = 0x0f;
-	buffer[20] = 0x0f;
-	buffer[21] = 0x0f;*/
-	buffer[7] = 0xff;
-	data_segment_upload_u8(cnum, 0xd00, buffer, 8);
-
 	/* code upload */
 	if (nva_cards[cnum].chipset < 0xd9) {
 		code_size = sizeof(nva3_pdaemon_code)/sizeof(*nva3_pdaemon_code);
@@ -172,20 +379,27 @@ static void pdaemon_upload(unsigned int cnum) {
 		code_size = sizeof(nvd9_pdaemon_code)/sizeof(*nvd9_pdaemon_code);
 		code = nvd9_pdaemon_code;
 	}
-	nva_wr32(cnum, 0x10a180, 0x01000000);
-	for (i = 0; i < code_size; ++i) {
-		if (i % 64 == 0)
-			nva_wr32(cnum, 0x10a188, i >> 6);
-		nva_wr32(cnum, 0x10a184, code[i]);
+	pdaemon_code = code;
+
+	/* only upload the resident part, overlays are uploaded on demand */
+	max_code_size = (nva_rd32(cnum, 0x10a108) & 0x1ff) << 8;
+	if (!pdaemon_ovl_init(max_code_size / PDAEMON_CODE_PAGE_SIZE, code_size)) {
+		mmio_trace_span_end();
+		return false;
 	}
+	resident_code_size = pdaemon_ovl[0].code_begin / 4;
+	if (resident_code_size > code_size)
+		resident_code_size = code_size;
+	code_segment_upload(cnum, 0, 0, code, resident_code_size);
 
 	/* launch */
 	nva_wr32(cnum, 0x10a104, 0x0);
 	nva_wr32(cnum, 0x10a10c, 0x0);
 	nva_wr32(cnum, 0x10a100, 0x2);
 
-	max_code_size = (nva_rd32(cnum, 0x10a0108) & 0x1ff) << 8;
-	max_data_size = (nva_rd32(cnum, 0x10a0108) & 0x1fe00) >> 1;
+	max_data_size = (nva_rd32(cnum, 0x10a108) & 0x1fe00) >> 1;
+
+	mmio_trace_span_end();
 
 	if (nva_cards[cnum].chipset < 0xd9) {
 		printf("Uploaded pdaemon microcode: data = 0x%lx bytes(%li%%), code = 0x%lx bytes(%li%%)\n",
@@ -200,6 +414,11 @@ static void pdaemon_upload(unsigned int cnum) {
 			sizeof(nvd9_pdaemon_code),
 			(sizeof(nvd9_pdaemon_code) * 100) / max_data_size);
 	}
+	printf("Resident pdaemon code = 0x%x bytes(%i%%), %i overlays\n",
+	       resident_code_size * 4, (resident_code_size * 4 * 100) / max_code_size,
+	       PDAEMON_OVL_COUNT);
+
+	return true;
 }
 
 static void pdaemon_RB_state_dump(unsigned int cnum)
@@ -213,6 +432,16 @@ static void pdaemon_RB_state_dump(unsigned int cnum)
 	printf("\n");
 }
 
+static void pdaemon_isr_latency_dump(unsigned int cnum)
+{
+	uint32_t last = 0, max = 0;
+
+	data_segment_read(cnum, PDAEMON_CORE_ISR_LATENCY_LAST, 4, (uint8_t*)(&last));
+	data_segment_read(cnum, PDAEMON_CORE_ISR_LATENCY_MAX, 4, (uint8_t*)(&max));
+
+	printf("PDAEMON's ISR latency: last = %u ns, max = %u ns\n", last, max);
+}
+
 struct pdaemon_resource_command {
 	/* in */
 	uint8_t pid;
@@ -234,27 +463,39 @@ static bool pdaemon_send_cmd(unsigned int cnum, struct pdaemon_resource_command
 	uint16_t dispatch_data_base_addr = PDAEMON_DISPATCH_DATA;
 	uint16_t dispatch_data_size = PDAEMON_DISPATCH_DATA_SIZE;
 
-	uint32_t put = nva_rd32(cnum, 0x10a4a0);
-	uint32_t next_put = dispatch_ring_base_addr + ((put - dispatch_ring_base_addr + 4) % 0x40);
-	uint32_t get = nva_rd32(cnum, 0x10a4b0);
-
-	uint8_t put_index = (put - dispatch_ring_base_addr) / 4;
-	uint8_t next_put_index = (next_put - dispatch_ring_base_addr) / 4;
-	uint8_t get_index = (get - dispatch_ring_base_addr) / 4;
+	uint32_t put, next_put, get;
+	uint8_t put_index, next_put_index, get_index;
 
 	uint32_t header = ((cmd->pid & 0xf) << 28);
 	uint32_t length = cmd->data_length;
 	uint32_t data_header_length = 0;
 
+	mmio_trace_span_begin("pdaemon_send_cmd");
+
+	/* PDAEMON would drop the command if the pid's overlay was missing */
+	if (!pdaemon_ovl_load_pid(cnum, cmd->pid)) {
+		mmio_trace_span_end();
+		return false;
+	}
+
+	put = nva_rd32(cnum, 0x10a4a0);
+	next_put = dispatch_ring_base_addr + ((put - dispatch_ring_base_addr + 4) % 0x40);
+	get = nva_rd32(cnum, 0x10a4b0);
+
+	put_index = (put - dispatch_ring_base_addr) / 4;
+	next_put_index = (next_put - dispatch_ring_base_addr) / 4;
+	get_index = (get - dispatch_ring_base_addr) / 4;
+
 	if (cmd->query_header > 0) {
 		data_header_length = 4;
 		length += data_header_length;
 	}
 
 	/* find some available space */
-	if (length > dispatch_data_size)
+	if (length > dispatch_data_size) {
+		mmio_trace_span_end();
 		return false;
-	else if ((dispatch_data_size - data_base[put_index]) > length)
+	} else if ((dispatch_data_size - data_base[put_index]) > length)
 		data_base[next_put_index] = data_base[put_index] + length;
 	else {
 		data_segment_read(cnum, PDAEMON_DISPATCH_FENCE, 4, (uint8_t*)(&fence_get));
@@ -268,10 +509,13 @@ static bool pdaemon_send_cmd(unsigned int cnum, struct pdaemon_resource_command
 			"PDAEMON's FIFO 0 state: Get(%08x) Put(%08x) Fence(%08x)\n",
 		       get_index, nva_rd32(cnum, 0x10a4b0), nva_rd32(cnum, 0x10a4a0), fence_get);
 
-		do {
+		get = nva_rd32(cnum, 0x10a4b0);
+		get_index = (get - dispatch_ring_base_addr) / 4;
+		while (data_base[get_index] < length) {
+			mmio_trace_spin();
 			get = nva_rd32(cnum, 0x10a4b0);
 			get_index = (get - dispatch_ring_base_addr) / 4;
-		} while (data_base[get_index] < length);
+		}
 
 		data_base[put_index] = 0;
 		data_base[next_put_index] = length;
@@ -302,12 +546,15 @@ static bool pdaemon_send_cmd(unsigned int cnum, struct pdaemon_resource_command
 		data_segment_upload_u8(cnum, cmd->data_addr, cmd->data, cmd->data_length);
 
 	/* wait for some space in the ring buffer */
-	while (next_put == nva_rd32(cnum, 0x10a4b0));
+	while (next_put == nva_rd32(cnum, 0x10a4b0))
+		mmio_trace_spin();
 
 	/* push the commands */
 	data_segment_upload_u32(cnum, put, &header, 1);
 	nva_wr32(cnum, 0x10a4a0, next_put);
 
+	mmio_trace_span_end();
+
 	return true;
 }
 
@@ -330,29 +577,439 @@ static struct pdaemon_resource_command pdaemon_resource_get_set(int cnum, uint8_
 	return cmd;
 }
 
+/* Returns false if PDAEMON dropped the command because its overlay was not
+ * resident (see dispatch_drop_fence).
+ */
 static bool pdaemon_sync_fence(int cnum, uint32_t waited_fence)
 {
-	uint32_t fence = 0;
+	uint32_t fence = 0, drop_fence = 0;
+
+	mmio_trace_span_begin("pdaemon_sync_fence");
 
 	/* wait for the command to be executed */
-	do {
+	data_segment_read(cnum, PDAEMON_DISPATCH_FENCE, 4, (uint8_t*)(&fence));
+	while (fence < waited_fence) {
+		mmio_trace_spin();
 		data_segment_read(cnum, PDAEMON_DISPATCH_FENCE, 4, (uint8_t*)(&fence));
-	} while(fence < waited_fence);
+	}
+
+	data_segment_read(cnum, PDAEMON_DISPATCH_DROP_FENCE, 4, (uint8_t*)(&drop_fence));
+
+	mmio_trace_span_end();
+
+	if (drop_fence == waited_fence) {
+		fprintf(stderr, "pdaemon_sync_fence: command %u was dropped, "
+			"its overlay was not resident\n", waited_fence);
+		return false;
+	}
 
 	return true;
 }
 
 static bool pdaemon_read_resource(int cnum, struct pdaemon_resource_command *cmd, uint8_t *buf)
 {
+	mmio_trace_span_begin("pdaemon_read_resource");
+
 	/* wait for the command to be executed */
-	pdaemon_sync_fence(cnum, cmd->fence);
+	if (!pdaemon_sync_fence(cnum, cmd->fence)) {
+		mmio_trace_span_end();
+		return false;
+	}
 
 	/* read the data back */
 	data_segment_read(cnum, cmd->data_addr, cmd->data_length, buf);
 
+	mmio_trace_span_end();
+
 	return true;
 }
 
+/* Send count resource gets to temp_mgmt (a core pid, dispatched from the ISR
+ * in the -DISR_DISPATCH build of the firmware) and report the ISR latency
+ * they caused. Run it against both builds to compare them.
+ */
+static void pdaemon_isr_latency_measure(int cnum, int count)
+{
+	struct pdaemon_resource_command cmd;
+	uint32_t zero = 0;
+	uint8_t buf[4];
+	int i;
+
+	data_segment_upload_u32(cnum, PDAEMON_CORE_ISR_LATENCY_MAX, &zero, 1);
+	for (i = 0; i < count; i++) {
+		cmd = pdaemon_resource_get_set(cnum, PDAEMON_TEMP_PID, get, 0, buf, sizeof(buf));
+		if (!pdaemon_read_resource(cnum, &cmd, buf))
+			break;
+	}
+
+	printf("%i resource gets: ", i);
+	pdaemon_isr_latency_dump(cnum);
+}
+
+struct pdaemon_temp_sample {
+	uint32_t time;		/* PTIMER, low 32 bits */
+	uint8_t temp;		/* °C */
+	uint8_t filtered;	/* °C */
+	uint16_t duty;		/* PWM duty */
+};
+
+/* Fetch the thermal history of PDAEMON in a single resource get. Returns the
+ * number of samples copied to samples, the oldest first.
+ */
+static int pdaemon_temp_history(int cnum, struct pdaemon_temp_sample *samples)
+{
+	struct pdaemon_resource_command cmd;
+	uint8_t buf[PDAEMON_TEMP_HIST - PDAEMON_TEMP_HIST_COUNT +
+		    PDAEMON_TEMP_HIST_SIZE * sizeof(*samples)];
+	uint32_t count, n, i;
+
+	cmd = pdaemon_resource_get_set(cnum, PDAEMON_TEMP_PID, get,
+				       PDAEMON_TEMP_HIST_COUNT - PDAEMON_TEMP_NAME,
+				       buf, sizeof(buf));
+	if (!pdaemon_read_resource(cnum, &cmd, buf))
+		return 0;
+
+	memcpy(&count, buf, 4);
+	n = count < PDAEMON_TEMP_HIST_SIZE ? count : PDAEMON_TEMP_HIST_SIZE;
+	for (i = 0; i < n; i++) {
+		uint32_t idx = (count - n + i) % PDAEMON_TEMP_HIST_SIZE;
+
+		memcpy(&samples[i], buf + PDAEMON_TEMP_HIST - PDAEMON_TEMP_HIST_COUNT +
+		       idx * sizeof(*samples), sizeof(*samples));
+	}
+
+	return n;
+}
+
+static void pdaemon_temp_history_dump(int cnum)
+{
+	struct pdaemon_temp_sample samples[PDAEMON_TEMP_HIST_SIZE];
+	int i, n = pdaemon_temp_history(cnum, samples);
+
+	printf("Temperature history (%i samples):\n", n);
+	for (i = 0; i < n; i++)
+		printf("	%08x: %3u°C (filtered %3u°C), duty = 0x%04x\n",
+		       samples[i].time, samples[i].temp, samples[i].filtered,
+		       samples[i].duty);
+}
+
+/* a point of a fan curve, the speed is linearly interpolated in-between */
+struct pdaemon_fan_point {
+	uint8_t temp;		/* °C */
+	uint8_t speed;		/* % */
+};
+
+/* Parse a fan curve given as "temp:speed[,temp:speed...]". The temperatures
+ * must be strictly increasing and the speeds at most 100%.
+ * Returns the number of points, -1 if str is malformed.
+ */
+static int pdaemon_fan_curve_parse(const char *str, struct pdaemon_fan_point *points, int max)
+{
+	unsigned int temp, speed;
+	int count = 0, n;
+
+	do {
+		if (count == max) {
+			fprintf(stderr, "fan curve: more than %i points\n", max);
+			return -1;
+		}
+
+		n = 0;
+		if (sscanf(str, "%u:%u%n", &temp, &speed, &n) != 2 || n == 0 ||
+		    (str[n] != ',' && str[n] != '\0')) {
+			fprintf(stderr, "fan curve: cannot parse \"%s\", "
+				"expected temp:speed[,temp:speed...]\n", str);
+			return -1;
+		}
+
+		if (temp > 0xff || speed > 100) {
+			fprintf(stderr, "fan curve: %u:%u out of range "
+				"(temp <= 255°C, speed <= 100%%)\n", temp, speed);
+			return -1;
+		}
+
+		if (count > 0 && temp <= points[count - 1].temp) {
+			fprintf(stderr, "fan curve: %u°C after %u°C, the temperatures "
+				"must be increasing\n", temp, points[count - 1].temp);
+			return -1;
+		}
+
+		points[count].temp = temp;
+		points[count].speed = speed;
+		count++;
+
+		str += n;
+	} while (*str++ == ',');
+
+	return count;
+}
+
+/* Turn a fan curve into the temperature -> PWM duty table of the table fan
+ * mode. points must be sorted by increasing temperature, the speed is
+ * constant before the first point and after the last one. Clamping to
+ * [pwm_min, pwm_max] and the conversion to a duty are done here as PDAEMON
+ * uses the table as-is, as long as the divisor it was built for is current.
+ */
+static void pdaemon_fan_table_build(const struct pdaemon_fan_point *points, int count,
+				    uint16_t divisor, uint8_t pwm_min, uint8_t pwm_max,
+				    uint16_t *table)
+{
+	int t, i, speed;
+
+	for (t = 0; t < PDAEMON_TEMP_TABLE_SIZE; t++) {
+		/* find the first point above t */
+		for (i = 0; i < count && points[i].temp <= t; i++);
+
+		if (i == 0)
+			speed = points[0].speed;
+		else if (i == count)
+			speed = points[count - 1].speed;
+		else {
+			const struct pdaemon_fan_point *a = &points[i - 1], *b = &points[i];
+			int dt = b->temp - a->temp;
+
+			speed = a->speed * dt + (b->speed - a->speed) * (t - a->temp);
+			speed = (speed + dt / 2) / dt;
+		}
+
+		if (speed < pwm_min)
+			speed = pwm_min;
+		if (speed > pwm_max)
+			speed = pwm_max;
+
+		/* same rounding as temp_set_pwm */
+		table[t] = (divisor * speed + 99) / 100;
+	}
+}
+
+/* Upload a fan curve to PDAEMON and switch to the table fan mode. The table
+ * is built for the current pwm id and divisor, PDAEMON falls back to its
+ * default fan mode if they change: call this again to rebuild it.
+ */
+static bool pdaemon_fan_table_set(int cnum, const struct pdaemon_fan_point *points, int count)
+{
+	struct pdaemon_resource_command cmd;
+	/* the duties then u16 divisor, u8 pwm id, u8 unused */
+	uint16_t table[PDAEMON_TEMP_TABLE_SIZE + 2];
+	uint8_t pwm[6], mode = PDAEMON_TEMP_MODE_TABLE;
+	uint16_t divisor;
+
+	if (count < 1)
+		return false;
+
+	/* u8 pwm_id, u8 pwm_cur, u16 divisor, u8 pwm_min, u8 pwm_max */
+	cmd = pdaemon_resource_get_set(cnum, PDAEMON_TEMP_PID, get,
+				       PDAEMON_TEMP_PWM_ID - PDAEMON_TEMP_NAME,
+				       pwm, sizeof(pwm));
+	if (!pdaemon_read_resource(cnum, &cmd, pwm))
+		return false;
+	divisor = pwm[2] | pwm[3] << 8;
+
+	pdaemon_fan_table_build(points, count, divisor, pwm[4], pwm[5], table);
+	table[PDAEMON_TEMP_TABLE_SIZE] = divisor;
+	table[PDAEMON_TEMP_TABLE_SIZE + 1] = pwm[0];
+
+	/* the table has to be complete before it gets used */
+	cmd = pdaemon_resource_get_set(cnum, PDAEMON_TEMP_PID, set,
+				       PDAEMON_TEMP_TABLE - PDAEMON_TEMP_NAME,
+				       (uint8_t *)table, sizeof(table));
+	if (!pdaemon_sync_fence(cnum, cmd.fence))
+		return false;
+
+	cmd = pdaemon_resource_get_set(cnum, PDAEMON_TEMP_PID, set,
+				       PDAEMON_TEMP_FAN_MODE - PDAEMON_TEMP_NAME,
+				       &mode, 1);
+	return pdaemon_sync_fence(cnum, cmd.fence);
+}
+
+/* sequence number of the last script queued in each FSE slot */
+static uint32_t FSE_slot_seq[PDAEMON_FSE_SLOT_COUNT] = { 0 };
+/* time the last script queued in each slot may take to run, given at submit */
+static ptime_t FSE_slot_timeout[PDAEMON_FSE_SLOT_COUNT] = { 0 };
+static uint32_t FSE_seq = 0;
+static uint8_t FSE_next_slot = 0;
+
+static uint32_t pdaemon_FSE_slot_fence(int cnum, uint8_t slot)
+{
+	uint32_t fence = 0;
+
+	data_segment_read(cnum, PDAEMON_FSE_SLOT_FENCE + slot * 4, 4, (uint8_t*)(&fence));
+
+	return fence;
+}
+
+/* Wait for PDAEMON to give the slot back after the script of sequence number
+ * seq. The scripts queued in the other slots may have to run first, hence the
+ * timeout is the sum of the ones given to pdaemon_FSE_submit for every slot,
+ * plus PDAEMON_FSE_TIMEOUT_SLACK.
+ * Returns FSE_timeout when it expires, FSE_failed if ovl_fse cannot be loaded
+ * and FSE_done otherwise, the script may still have been rejected.
+ */
+static FSE_status pdaemon_FSE_wait(int cnum, uint8_t slot, uint32_t seq)
+{
+	ptime_t start = 0, timeout = PDAEMON_FSE_TIMEOUT_SLACK;
+	bool waiting = false;
+	int i;
+
+	/* the queued scripts cannot run if ovl_fse got evicted meanwhile */
+	if (!pdaemon_ovl_load(cnum, PDAEMON_OVL_FSE))
+		return FSE_failed;
+
+	for (i = 0; i < PDAEMON_FSE_SLOT_COUNT; i++)
+		timeout += FSE_slot_timeout[i];
+
+	while (pdaemon_FSE_slot_fence(cnum, slot) < seq) {
+		/* only read PTIMER once we actually have to wait */
+		if (!waiting) {
+			start = get_time(cnum);
+			waiting = true;
+		} else if (get_time(cnum) - start > timeout) {
+			fprintf(stderr, "pdaemon_FSE_wait: timeout on script %u, slot %u\n",
+				seq, slot);
+			return FSE_timeout;
+		}
+		mmio_trace_spin();
+	}
+
+	return FSE_done;
+}
+
+/* Wait for PDAEMON to be done with the script of sequence number seq.
+ * Returns FSE_rejected if PDAEMON did not run it (see FSE_error_seq), the
+ * status of pdaemon_FSE_wait otherwise.
+ */
+static FSE_status pdaemon_FSE_sync(int cnum, uint8_t slot, uint32_t seq)
+{
+	uint32_t error_seq = 0;
+	FSE_status ret;
+
+	mmio_trace_span_begin("pdaemon_FSE_sync");
+
+	ret = pdaemon_FSE_wait(cnum, slot, seq);
+	if (ret == FSE_done) {
+		data_segment_read(cnum, PDAEMON_FSE_ERROR_SEQ, 4, (uint8_t*)(&error_seq));
+		if (error_seq == seq) {
+			fprintf(stderr, "pdaemon_FSE_sync: script %u was rejected\n", seq);
+			ret = FSE_rejected;
+		}
+	}
+
+	mmio_trace_span_end();
+
+	return ret;
+}
+
+/* Upload a script to the next FSE slot and queue it for execution. The slots
+ * are used in a round-robin fashion so as the next script can be uploaded
+ * while the previous one is being executed. timeout is the time the script
+ * may take to run (delays, waits and loops included), in ns.
+ * Returns the sequence number to pass to pdaemon_FSE_sync, 0 on error.
+ */
+static uint32_t pdaemon_FSE_submit(int cnum, uint8_t *script, uint16_t length,
+				   ptime_t timeout, uint8_t *slot_out)
+{
+	struct pdaemon_resource_command cmd;
+	uint8_t slot = FSE_next_slot;
+	uint32_t seq;
+
+	if (length > PDAEMON_FSE_SLOT_SIZE)
+		return 0;
+
+	mmio_trace_span_begin("pdaemon_FSE_submit");
+
+	/* wait for PDAEMON to give the slot back */
+	if (pdaemon_FSE_wait(cnum, slot, FSE_slot_seq[slot]) != FSE_done) {
+		mmio_trace_span_end();
+		return 0;
+	}
+
+	data_segment_upload_u8(cnum, PDAEMON_FSE_SLOTS + slot * PDAEMON_FSE_SLOT_SIZE,
+			       script, length);
+
+	/* queue it: u8 cmd, u8 slot, u16 unused, u32 seq */
+	seq = ++FSE_seq;
+	cmd.pid = PDAEMON_FSE_PID;
+	cmd.query_header = PDAEMON_FSE_CMD_QUEUE | (slot << 8);
+	cmd.data = (uint8_t *)&seq;
+	cmd.data_length = 4;
+	if (!pdaemon_send_cmd(cnum, &cmd)) {
+		mmio_trace_span_end();
+		return 0;
+	}
+
+	FSE_slot_seq[slot] = seq;
+	FSE_slot_timeout[slot] = timeout;
+	FSE_next_slot = (slot + 1) % PDAEMON_FSE_SLOT_COUNT;
+	if (slot_out)
+		*slot_out = slot;
+
+	mmio_trace_span_end();
+
+	return seq;
+}
+
+/* Same as pdaemon_FSE_submit but the script is compressed and sent along with
+ * the queue command, PDAEMON unpacks it into the slot. This saves most of the
+ * BAR0 writes of the upload. Falls back to pdaemon_FSE_submit when the script
+ * does not compress.
+ */
+static uint32_t pdaemon_FSE_submit_lz(int cnum, uint8_t *script, uint16_t length,
+				      ptime_t timeout, uint8_t *slot_out)
+{
+	struct pdaemon_resource_command cmd;
+	uint8_t buf[4 + PDAEMON_FSE_LZ_SIZE];
+	uint8_t slot = FSE_next_slot;
+	uint16_t lz_length;
+	uint32_t seq;
+
+	if (length > PDAEMON_FSE_SLOT_SIZE)
+		return 0;
+
+	lz_length = FSE_lz_compress(script, length, buf + 4, PDAEMON_FSE_LZ_SIZE);
+	if (lz_length == 0 || lz_length >= length)
+		return pdaemon_FSE_submit(cnum, script, length, timeout, slot_out);
+
+	mmio_trace_span_begin("pdaemon_FSE_submit_lz");
+
+	/* PDAEMON unpacks the script in the slot, wait for it to be free */
+	if (pdaemon_FSE_wait(cnum, slot, FSE_slot_seq[slot]) != FSE_done) {
+		mmio_trace_span_end();
+		return 0;
+	}
+
+	/* u8 cmd, u8 slot, u16 unpacked size, u32 seq, compressed script */
+	seq = ++FSE_seq;
+	memcpy(buf, &seq, 4);
+	cmd.pid = PDAEMON_FSE_PID;
+	cmd.query_header = PDAEMON_FSE_CMD_QUEUE_LZ | (slot << 8) | (length << 16);
+	cmd.data = buf;
+	cmd.data_length = 4 + lz_length;
+	if (!pdaemon_send_cmd(cnum, &cmd)) {
+		mmio_trace_span_end();
+		return 0;
+	}
+
+	FSE_slot_seq[slot] = seq;
+	FSE_slot_timeout[slot] = timeout;
+	FSE_next_slot = (slot + 1) % PDAEMON_FSE_SLOT_COUNT;
+	if (slot_out)
+		*slot_out = slot;
+
+	mmio_trace_span_end();
+
+	return seq;
+}
+
+/* time PDAEMON spent unpacking the last compressed script, in ns */
+static uint32_t pdaemon_FSE_lz_unpack_time(int cnum)
+{
+	uint32_t time = 0;
+
+	data_segment_read(cnum, PDAEMON_FSE_LZ_UNPACK_TIME, 4, (uint8_t*)(&time));
+
+	return time;
+}
+
 static uint32_t ring_wrap_around(int cur_pos, int bump, uint32_t ring_base, uint32_t ring_size)
 {
 	return ((cur_pos + bump) % ring_size) + ring_base;  
@@ -392,10 +1049,13 @@ int rdispatch_read_msg(int cnum, struct rdispatch_msg *msg){
 	uint32_t RFIFO_PUT;
 	uint8_t header_buf[0x4];
 
+	mmio_trace_span_begin("rdispatch_read_msg");
+
 	RFIFO_GET = nva_rd32(cnum, 0x10a4cc);
 	RFIFO_PUT = nva_rd32(cnum, 0x10a4c8);
 
 	if ( RFIFO_GET == RFIFO_PUT ){
+		mmio_trace_span_end();
 		return 1;
 	} else {
 		//data_segment_read(cnum, RFIFO_GET, 0x4, header_buf);
@@ -411,6 +1071,8 @@ int rdispatch_read_msg(int cnum, struct rdispatch_msg *msg){
 		RFIFO_GET = nva_rd32(cnum, 0x10a4cc);
 		nva_wr32(cnum, 0x10a4cc, ring_wrap_around( RFIFO_GET, 3 + header_buf[2], 0xa00, RDISPATCH_SIZE));
 	}
+
+	mmio_trace_span_end();
     
 	return 0;
 }
@@ -419,17 +1081,37 @@ int rdispatch_read_msg(int cnum, struct rdispatch_msg *msg){
 int main(int argc, char **argv)
 {
 	int RFIFO_PUT;
+	uint8_t buffer[17], slot;
+	uint32_t seq;
+	const char *trace_path = NULL;
+	FILE *trace;
+	struct pdaemon_fan_point fan_curve[16];
+	int fan_curve_len = 0;
+	int isr_latency_count = 0;
 	if (nva_init()) {
 		fprintf (stderr, "PCI init failure!\n");
 		return 1;
 	}
 	int c;
 	int cnum =0;
-	while ((c = getopt (argc, argv, "c:")) != -1)
+	while ((c = getopt (argc, argv, "c:t:f:l:")) != -1)
 		switch (c) {
 			case 'c':
 				sscanf(optarg, "%d", &cnum);
 				break;
+			case 't':
+				trace_path = optarg;
+				break;
+			case 'l':
+				/* measure the ISR latency over N commands */
+				sscanf(optarg, "%d", &isr_latency_count);
+				break;
+			case 'f':
+				/* fan curve: temp:speed[,temp:speed...] */
+				fan_curve_len = pdaemon_fan_curve_parse(optarg, fan_curve, 16);
+				if (fan_curve_len < 0)
+					return 1;
+				break;
 		}
 	if (cnum >= nva_cardsnum) {
 		if (nva_cardsnum)
@@ -439,15 +1121,64 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	pdaemon_upload(cnum);
+	if (trace_path)
+		mmio_trace_start();
+
+	if (!pdaemon_upload(cnum))
+		return 1;
+	pdaemon_ovl_load(cnum, PDAEMON_OVL_FAN);
 	usleep(1000);
 
+	if (isr_latency_count > 0)
+		pdaemon_isr_latency_measure(cnum, isr_latency_count);
+
+	if (fan_curve_len > 0 && !pdaemon_fan_table_set(cnum, fan_curve, fan_curve_len))
+		fprintf(stderr, "Failed to set the fan curve\n");
+
+	/* run a test script: send_msg(5, 15, 25, 36, 46, 56); exit */
+	buffer[0] = 0x20;
+	buffer[1] = 5;
+	buffer[2] = 0;
+	buffer[3] = 15;
+	buffer[4] = 25;
+	buffer[5] = 36;
+	buffer[6] = 46;
+	buffer[7] = 56;
+	buffer[8] = 0xff;
+	seq = pdaemon_FSE_submit(cnum, buffer, 9, 0, &slot);
+	if (!seq || pdaemon_FSE_sync(cnum, slot, seq) != FSE_done)
+		fprintf(stderr, "FSE: the test script failed\n");
+
+	/* same message twice, compressed: send_msg(...); send_msg(...); exit */
+	memcpy(buffer + 8, buffer, 8);
+	buffer[16] = 0xff;
+	seq = pdaemon_FSE_submit_lz(cnum, buffer, 17, 0, &slot);
+	if (!seq || pdaemon_FSE_sync(cnum, slot, seq) != FSE_done)
+		fprintf(stderr, "FSE: the compressed test script failed\n");
+	else
+		printf("FSE: compressed script unpacked in %u ns\n",
+		       pdaemon_FSE_lz_unpack_time(cnum));
+
 	/*while(1){*/
 	RFIFO_PUT = nva_rd32(cnum, 0x10a4c8);
 	
 		data_segment_dump(cnum, RFIFO_PUT, 0x10);
+		pdaemon_isr_latency_dump(cnum);
+		pdaemon_temp_history_dump(cnum);
 		
 		usleep(5000);
 	//}
+
+	if (trace_path) {
+		trace = fopen(trace_path, "w");
+		if (trace) {
+			mmio_trace_write_json(trace);
+			fclose(trace);
+		} else
+			fprintf(stderr, "Cannot open %s\n", trace_path);
+		mmio_trace_summary(stdout);
+		mmio_trace_stop();
+	}
+
 	return 0;
 }